@@ -0,0 +1,89 @@
+#!/bin/sh
+# performance benchmarks for jobflow.
+# prints one tab-separated line per benchmark:
+#   binary name unit median min max stddev runs
+# where the values are rates (higher is better) over $RUNS runs.
+# set JF_BASE to a second jobflow binary to compare against, e.g. one built
+# from the previous release; its results are printed right below, followed
+# by a line with the ratio of the medians.
+test -z "$JF" && JF=./jobflow
+test -z "$RUNS" && RUNS=5
+test -z "$JOBS" && JOBS=2000
+test -z "$MB" && MB=64
+TMP=/tmp/jobflow.bench.$$
+
+gcc tests/stdin_printer.c -o tests/stdin_printer.out || { echo error compiling tests/stdin_printer.c ; exit 1 ; }
+
+cleanup() {
+	rm -f $TMP.*
+}
+trap cleanup EXIT INT TERM
+
+seq $JOBS > $TMP.jobs
+seq 10000000 | head -c $((MB * 1024 * 1024)) > $TMP.data
+
+now() {
+	date +%s%N
+}
+
+# run_one bin name unit amount command...
+# runs command $RUNS times with $JFBIN set to the jobflow binary bin.
+# amount is the number of units processed by one run of command,
+# which reads $TMP.in on stdin.
+run_one() {
+	bin=$1 ; name=$2 ; unit=$3 ; amount=$4
+	shift 4
+	i=0
+	while [ $i -lt $RUNS ] ; do
+		start=$(now)
+		JFBIN=$bin eval "$@" < $TMP.in > /dev/null 2>&1
+		end=$(now)
+		echo "$amount $start $end"
+		i=$((i + 1))
+	done | awk -v bin="$bin" -v name="$name" -v unit="$unit" '
+	{ r[NR] = $1 / (($3 - $2) / 1e9) ; sum += r[NR] }
+	END {
+		n = NR
+		for(i = 1; i <= n; i++) for(j = i + 1; j <= n; j++)
+			if(r[j] < r[i]) { t = r[i] ; r[i] = r[j] ; r[j] = t }
+		med = n % 2 ? r[(n + 1) / 2] : (r[n / 2] + r[n / 2 + 1]) / 2
+		mean = sum / n
+		for(i = 1; i <= n; i++) var += (r[i] - mean) ^ 2
+		printf "%s\t%s\t%s\t%.1f\t%.1f\t%.1f\t%.1f\t%d\n", bin, name, unit, med, r[1], r[n], sqrt(var / n), n
+	}'
+}
+
+bench() {
+	run_one "$JF" "$@" | tee $TMP.cur
+	if [ -n "$JF_BASE" ] ; then
+		run_one "$JF_BASE" "$@" | tee $TMP.base
+		paste $TMP.cur $TMP.base | awk -F '\t' '{ printf "ratio\t%s\t%s\t%.3f\n", $2, $3, $4 / $12 }'
+	fi
+}
+
+cp $TMP.jobs $TMP.in
+for t in 1 4 16 64 ; do
+	bench "exec true ${t}x" jobs/s $JOBS '$JFBIN -threads=$t -exec true {}'
+done
+bench "exec true buffered 16x" jobs/s $JOBS '$JFBIN -threads=16 -buffered -exec true {}'
+bench "exec true spawners 4 16x" jobs/s $JOBS '$JFBIN -threads=16 -spawners=4 -exec true {}'
+bench "exec true statefile 16x" jobs/s $JOBS '$JFBIN -threads=16 -statefile=$TMP.state -exec true {}'
+bench "exec true statefile delayedflush 16x" jobs/s $JOBS '$JFBIN -threads=16 -statefile=$TMP.state -delayedflush -exec true {}'
+
+# scaling: enough jobs to fill every slot a few times
+for t in 256 1024 4096 ; do
+	seq $((t * 3)) > $TMP.in
+	bench "exec true ${t}x" jobs/s $((t * 3)) '$JFBIN -threads=$t -exec true {}'
+done
+
+cp $TMP.data $TMP.in
+lines=$(wc -l < $TMP.data)
+bench "catmode" MB/s $MB '$JFBIN'
+bench "skip" lines/s $lines '$JFBIN -skip=$lines -exec true {}'
+bench "pipe linecat 4x" MB/s $MB '$JFBIN -threads=4 -exec tests/stdin_printer.out'
+bench "pipe cat 4x" MB/s $MB '$JFBIN -threads=4 -exec cat'
+bench "pipe cat coalesce 64K 4x" MB/s $MB '$JFBIN -threads=4 -coalesce=64K -exec cat'
+bench "pipe cat uring 4x" MB/s $MB '$JFBIN -threads=4 -uring -exec cat'
+bench "pipe cat bulk 64K 4x" MB/s $MB '$JFBIN -threads=4 -bulk=64K -exec cat'
+bench "pipe cat bulk 64K recsize 4x" MB/s $MB '$JFBIN -threads=4 -bulk=64K -recsize=64 -exec cat'
+bench "pipe cat bulk 64K buffered 4x" MB/s $MB '$JFBIN -threads=4 -bulk=64K -buffered -exec cat'
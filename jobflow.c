@@ -33,6 +33,8 @@ SOFTWARE.
 #define _GNU_SOURCE
 
 #include "sblist.h"
+#include "jobflow_plugin.h"
+#include "libjobflow.h"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -48,6 +50,7 @@ SOFTWARE.
 #include <assert.h>
 #include <ctype.h>
 #include <sys/mman.h>
+#include <math.h>
 
 /* process handling */
 
@@ -55,22 +58,70 @@ SOFTWARE.
 #include <spawn.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <dlfcn.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/syscall.h>
+#include <sys/file.h>
 
 #include <sys/resource.h>
 
-#if defined(__GLIBC__) && (__GLIBC__ < 3) && (__GLIBC_MINOR__ < 13)
-/* http://repo.or.cz/w/glibc.git/commitdiff/c08fb0d7bba4015078406b28d3906ccc5fda9d5a ,
- * http://repo.or.cz/w/glibc.git/commitdiff/052fa7b33ef5deeb4987e5264cf397b3161d8a01 */
-#warning to use prlimit() you have to use musl libc 0.8.4+ or glibc 2.13+
-static int prlimit(int pid, ...) {
-	(void) pid;
-	dprintf(2, "prlimit() not implemented on this system\n");
-	errno = EINVAL;
-	return -1;
-}
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_URING
+#endif
 #endif
 
-#include <sys/time.h>
+/* USDT probes for bpftrace, perf and systemtap, e.g.
+   bpftrace -e 'usdt:./jobflow:jobflow:job_reaped { @ms = hist(arg3); }'
+   each is a single nop and a test of its semaphore, which tracers set
+   while attached, so the arguments are only evaluated then. without
+   <sys/sdt.h> they compile to nothing.
+     line_dispatched(lineno, line, len)
+     job_spawned(slot, pid, lineno)
+     job_reaped(slot, lineno, status, ms)
+     statefile_written(n)
+     output_dumped(slot, is_stderr, bytes)
+     read_chunk(bytes) */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define HAVE_SDT
+#endif
+#endif
+#ifdef HAVE_SDT
+#define PROBE_SEMAPHORE(name) \
+	volatile unsigned short jobflow_##name##_semaphore \
+	__attribute__((unused, section(".probes")))
+PROBE_SEMAPHORE(line_dispatched);
+PROBE_SEMAPHORE(job_spawned);
+PROBE_SEMAPHORE(job_reaped);
+PROBE_SEMAPHORE(statefile_written);
+PROBE_SEMAPHORE(output_dumped);
+PROBE_SEMAPHORE(read_chunk);
+#define PROBE_ENABLED(name) __builtin_expect(jobflow_##name##_semaphore, 0)
+#define PROBE1(name, a) do { if(PROBE_ENABLED(name)) \
+	DTRACE_PROBE1(jobflow, name, a); } while(0)
+#define PROBE3(name, a, b, c) do { if(PROBE_ENABLED(name)) \
+	DTRACE_PROBE3(jobflow, name, a, b, c); } while(0)
+#define PROBE4(name, a, b, c, d) do { if(PROBE_ENABLED(name)) \
+	DTRACE_PROBE4(jobflow, name, a, b, c, d); } while(0)
+#else
+#define PROBE1(name, a) do {} while(0)
+#define PROBE3(name, a, b, c) do {} while(0)
+#define PROBE4(name, a, b, c, d) do {} while(0)
+#endif
+
+#define die(...) do { dprintf(2, "error: " __VA_ARGS__); exit(1); } while(0)
 
 /* some small helper funcs from libulz */
 
@@ -83,6 +134,18 @@ static int msleep(long millisecs) {
         return ret;
 }
 
+static long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static long long now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
 static const char ulz_conv_cypher[] =
 	"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
 #define ulz_conv_cypher_len (sizeof(ulz_conv_cypher) - 1)
@@ -127,10 +190,42 @@ static size_t mktempdir(const char* prefix, char* buffer, size_t bufsize) {
 }
 
 
+/* what to do with a job's fds before it's executed, like the
+   posix_spawn_file_actions, see spawn_posix() and spawn_job() */
 typedef struct {
-	pid_t pid;
+	enum { FA_CLOSE, FA_DUP2, FA_OPEN } op;
+	int fd, src, flags;
+	char *path;
+} spawn_action;
+#define MAX_SPAWN_ACTIONS 12
+
+typedef struct {
+	pid_t pid; /* -1 for a free slot, 0 while a -spawners thread starts it */
 	int pipe;
-	posix_spawn_file_actions_t fa;
+	spawn_action fa[MAX_SPAWN_ACTIONS];
+	unsigned nfa;
+	char *spawn_argv; /* packed argv for the -spawners thread */
+	int spawn_close[2]; /* the child's pipe ends, closed by it after the spawn */
+	long long started; /* launch time in ms, see now_ms() */
+	unsigned long long lineno; /* the line the job was started for */
+	char *args; /* packed copy of the job's argv, kept for -speculate */
+	long twin; /* slot running another copy of the same line, or -1 */
+	bool killed; /* lost the speculation race, its output is discarded */
+	unsigned long long lines_in, bytes_in; /* passed to the job in pipe mode */
+	char *stage; /* -coalesce: lines not yet written to the job */
+	size_t staged;
+	/* captured stdout, see capture_output() */
+	int out;
+	char *obuf;
+	size_t ostart, olen, ocap;
+	bool opart; /* -linebuffered: only a part of the current line was written */
+	/* -merge: key of the first line in obuf */
+	size_t head_len, key_off, key_len;
+	double key_num;
+	enum merge_state { MS_NONE = 0, MS_WAIT, MS_HEAD, MS_DONE } mstate;
+	uint64_t trace_start;
+	size_t stream; /* -stream the job was started for */
+	uint64_t cache_key, cache_check; /* -cache key of the job's command */
 } job_info;
 
 typedef struct {
@@ -138,17 +233,35 @@ typedef struct {
 	struct rlimit rl;
 } limit_rec;
 
+typedef struct {
+	unsigned long long lineno;
+	double cost;
+	size_t len;
+	char *line;
+} pending_line;
+
+enum cost_mode {
+	COST_NONE = 0,
+	COST_SIZE,
+	COST_FIELD,
+};
+
 typedef struct {
 	char temp_state[256];
 	char* cmd_argv[4096];
 	sblist* job_infos;
 	sblist* subst_entries;
 	sblist* limits;
+	sblist* window; /* lines pending in the -lookahead window */
 	char* tempdir;
 	unsigned long long lineno;
 
 	char* statefile;
 	char* eof_marker;
+	char* plugin; /* shared object processing the lines in-process */
+	char* out_template; /* file to redirect the job's stdout to */
+	char* err_template;
+	char out_path[4096], err_path[4096]; /* ...substituted for the current line */
 	unsigned long numthreads;
 	unsigned long threads_running;
 	unsigned long skip;
@@ -161,6 +274,54 @@ typedef struct {
 				parallel connection tries on startup.
 				*/
 	unsigned long bulk_bytes;
+	char rs[32]; /* input record separator, "\n" by default */
+	unsigned rs_len; /* 0 for fixed size records */
+	unsigned long recsize; /* size of fixed records, see -recsize */
+	unsigned long coalesce; /* size of the per worker staging buffers */
+	unsigned long coalesce_delay; /* max ms a line stays staged */
+	double rate; /* max job launches per second */
+	unsigned long burst; /* launches allowed at once after an idle time */
+	unsigned long bwlimit; /* max bytes per second passed in pipe mode */
+	unsigned long speculate; /* relaunch jobs running longer than N times the median */
+	unsigned long lookahead; /* size of the window of pending lines ordered by cost */
+	unsigned long cost_field;
+	enum cost_mode cost_mode;
+	int delim; /* field separator, 0 for runs of blanks */
+	bool fields; /* -delim was given, so {N} in -exec are placeholders */
+	unsigned long part_field; /* route pipe mode lines by the hash of this field */
+	unsigned long part_start, part_end; /* ...or of this byte range */
+	unsigned long long jobs_started, jobs_failed, jobs_finished;
+	unsigned long halt; /* stop launching after this many failed jobs */
+	double halt_percent; /* ...or once this share of the finished jobs failed */
+	unsigned long halt_min; /* finished jobs needed before halt_percent applies */
+	unsigned long long halt_lineno; /* lowest line to run again after a halt */
+	unsigned long long launch_lineno; /* line number of the job launched next */
+	unsigned long merge_key; /* field to merge on, 0 for the whole line */
+	unsigned long readahead; /* size of the ring filled by the reader thread */
+	unsigned long spill_max; /* max bytes waiting in the spill file */
+	char* spill;
+	char* trace; /* file to write the chrome trace json to */
+	sblist* walk; /* directories to walk instead of reading stdin */
+	char* walk_name; /* glob the names of walked entries must match */
+	int walk_type; /* DT_* type of entries to emit, or 0 for any */
+	unsigned long walk_threads;
+	unsigned long spawners; /* threads starting the jobs */
+	double cost_hint; /* file size of the current line, as found by -walk */
+	sblist* stream_specs; /* -stream arguments */
+	char* cache; /* file memoizing the succeeded commands */
+	unsigned long cache_age; /* evict entries unused for this many seconds */
+	unsigned long cache_max; /* max size of the cached output */
+	uint64_t cache_key, cache_check; /* of the job launched next */
+	bool cache_stat; /* include size and mtime of the file named by the line */
+	unsigned long dedup_bloom; /* expected distinct lines for the bloom filter */
+	double dedup_fp; /* its false positive rate */
+	unsigned long long dedup_dropped;
+	bool dedup; /* drop lines seen before */
+	bool dag; /* run the input as a dependency graph */
+	bool dag_resume;
+	bool uring; /* do the dispatcher's bulk i/o through an io_uring */
+	unsigned long trace_size; /* number of events kept */
+	struct pollfd *pfds;
 
 	bool pipe_mode;
 	bool use_seqnr;
@@ -171,6 +332,14 @@ typedef struct {
 			   this means faster program execution, but could also be imprecise if the number of
 			   jobs is small or smaller than the available threadcount. */
 	bool join_output; /* join stdout and stderr of launched jobs into stdout */
+	bool stats; /* print statistics to stderr at exit */
+	bool merge; /* k-way merge the sorted stdout of the pipe mode workers */
+	bool line_output; /* pass on the output of jobs line by line */
+	bool tag; /* prefix output lines with the job's line number */
+	bool merge_numeric;
+	bool input_done;
+	bool halt_kill; /* terminate the running jobs when halting */
+	bool halted; /* a halt policy triggered, no jobs are launched anymore */
 
 	unsigned cmd_startarg;
 } prog_state_s;
@@ -180,19 +349,340 @@ static prog_state_s prog_state;
 
 extern char** environ;
 
+/* -trace: a timeline of what the dispatcher spends its time on, and of the
+   job running in each slot. events are stored into a ring allocated at
+   startup, which keeps the last -tracesize of them, and written out as
+   chrome trace json (for chrome://tracing or ui.perfetto.dev) at exit or
+   on SIGUSR1. recording an event costs a clock_gettime() and an atomic
+   increment, so it can stay enabled in production runs. */
+enum trace_kind {
+	TR_READ = 0,
+	TR_SUBST,
+	TR_SPAWN,
+	TR_WAIT,
+	TR_WRITE,
+	TR_STATEFILE,
+	TR_DUMP,
+	TR_JOB,
+};
+static const struct { const char name[10], arg[6]; } trace_tab[] = {
+	[TR_READ] = {"read", "bytes"},
+	[TR_SUBST] = {"subst", "line"},
+	[TR_SPAWN] = {"spawn", "slot"},
+	[TR_WAIT] = {"wait", "slot"},
+	[TR_WRITE] = {"write", "slot"},
+	[TR_STATEFILE] = {"statefile", "line"},
+	[TR_DUMP] = {"dump", "slot"},
+	[TR_JOB] = {"job", "line"},
+};
+#define TRACE_TID_MAIN 1
+#define TRACE_TID_READER 2
+#define TRACE_TID_SLOT 16 /* + slot index */
+
+typedef struct {
+	uint64_t ts, dur, arg;
+	unsigned tid;
+	enum trace_kind kind;
+} trace_event;
+
+static struct {
+	trace_event *ev;
+	_Atomic size_t n;
+	uint64_t t0;
+	volatile sig_atomic_t dump; /* SIGUSR1 received */
+} trace;
+
+static _Thread_local unsigned trace_tid = TRACE_TID_MAIN;
+
+/* returns 0 when tracing is off, so it can be used unconditionally */
+static uint64_t trace_now(void) {
+	struct timespec ts;
+	if(!trace.ev) return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void trace_write(void) {
+	char tmp[4096];
+	size_t i, n = atomic_load(&trace.n), first = 0;
+	FILE *f;
+
+	trace.dump = 0;
+	if(n > prog_state.trace_size) first = n - prog_state.trace_size;
+	snprintf(tmp, sizeof tmp, "%s.%u", prog_state.trace, (unsigned) getpid());
+	if(!(f = fopen(tmp, "w"))) {
+		perror("fopen");
+		return;
+	}
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for(i = first; i < n; i++) {
+		trace_event *e = &trace.ev[i % prog_state.trace_size];
+		/* still being written by another thread */
+		if(e->ts < trace.t0) continue;
+		fprintf(f, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+			"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"%s\":%llu}},\n",
+			trace_tab[e->kind].name, e->tid, (e->ts - trace.t0) / 1000.0,
+			e->dur / 1000.0, trace_tab[e->kind].arg, (unsigned long long) e->arg);
+	}
+	for(i = 0; i < prog_state.numthreads; i++)
+		fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,"
+			"\"args\":{\"name\":\"slot %zu\"}},\n", TRACE_TID_SLOT + i, i);
+	if(prog_state.readahead)
+		fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+			"\"args\":{\"name\":\"reader\"}},\n", TRACE_TID_READER);
+	fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+		"\"args\":{\"name\":\"dispatcher\"}}\n]}\n", TRACE_TID_MAIN);
+	if(fclose(f) == EOF) perror("fclose");
+	else if(rename(tmp, prog_state.trace) == -1) perror("rename");
+}
+
+/* record an event of the given thread which began at start and ends now */
+static void trace_add(enum trace_kind kind, unsigned tid, uint64_t start, uint64_t arg) {
+	if(!trace.ev) return;
+	trace_event *e = &trace.ev[atomic_fetch_add(&trace.n, 1) % prog_state.trace_size];
+	*e = (trace_event) {.ts = start, .dur = trace_now() - start, .arg = arg, .tid = tid, .kind = kind};
+	if(trace.dump && trace_tid == TRACE_TID_MAIN) trace_write();
+}
+
+static void trace_end(enum trace_kind kind, uint64_t start, uint64_t arg) {
+	trace_add(kind, trace_tid, start, arg);
+}
+
 static int makeLogfilename(char* buf, size_t bufsize, size_t jobindex, int is_stderr) {
 	int ret = snprintf(buf, bufsize, "%s/jd_proc_%.5lu_std%s.log",
 			   prog_state.tempdir, (unsigned long) jobindex, is_stderr ? "err" : "out");
 	return ret > 0 && (size_t) ret < bufsize;
 }
 
+/* store argv as a sequence of nul-terminated strings, terminated by an
+   empty string, so the exact command can be started again later. */
+static char* pack_argv(char** argv) {
+	size_t i, l = 1;
+	char *ret, *p;
+	for(i = 0; argv[i]; i++) l += strlen(argv[i]) + 1;
+	if(!(p = ret = malloc(l))) return 0;
+	for(i = 0; argv[i]; i++) p = stpcpy(p, argv[i]) + 1;
+	*p = 0;
+	return ret;
+}
+
+static void unpack_argv(char* packed, char** argv, size_t max) {
+	size_t i;
+	for(i = 0; *packed && i + 1 < max; i++) {
+		argv[i] = packed;
+		packed += strlen(packed) + 1;
+	}
+	argv[i] = NULL;
+}
+
+/* with -merge or -linebuffered the stdout of every job is read by jobflow through a pipe,
+   instead of going to our stdout directly. */
+static int capture_output(void) {
+	return prog_state.merge || prog_state.line_output;
+}
+
+static size_t merge_waiting, *merge_heap, merge_heap_n;
+
+static void fa_add(job_info *job, int op, int fd, int src, const char *path, int flags) {
+	spawn_action *a = &job->fa[job->nfa++];
+	assert(job->nfa <= MAX_SPAWN_ACTIONS);
+	*a = (spawn_action) {.op = op, .fd = fd, .src = src, .flags = flags};
+	/* a copy, as a -spawners thread uses it after the next line was read */
+	if(path && !(a->path = strdup(path))) die("out of memory\n");
+}
+
+static void fa_free(job_info *job) {
+	unsigned i;
+	for(i = 0; i < job->nfa; i++) free(job->fa[i].path);
+	job->nfa = 0;
+}
+
+/* start argv with posix_spawnp() and the fd actions of job. returns the
+   pid, or -1 with the error in *err and the failed call in *what. */
+static pid_t spawn_posix(job_info *job, char **argv, int *err, const char **what) {
+	posix_spawn_file_actions_t fa;
+	pid_t pid = -1;
+	unsigned i;
+
+	*what = "posix_spawn";
+	if((*err = posix_spawn_file_actions_init(&fa))) return -1;
+	for(i = 0; i < job->nfa && !*err; i++) {
+		spawn_action *a = &job->fa[i];
+		switch(a->op) {
+		case FA_CLOSE:
+			*err = posix_spawn_file_actions_addclose(&fa, a->fd);
+			break;
+		case FA_DUP2:
+			*err = posix_spawn_file_actions_adddup2(&fa, a->src, a->fd);
+			break;
+		case FA_OPEN:
+			*err = posix_spawn_file_actions_addopen(&fa, a->fd, a->path, a->flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+			break;
+		}
+	}
+	if(!*err) *err = posix_spawnp(&pid, argv[0], &fa, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	return *err ? -1 : pid;
+}
+
+/* start argv with the fd actions of job, and the -limits applied before
+   it's executed, which posix_spawn() can't do. used with -limits and by
+   the -spawners threads. the child shares our memory until the exec, so
+   it can report a failed exec in *err, and in *what the file or the call
+   which failed. returns the pid, or -1 if vfork failed. */
+static pid_t spawn_job(job_info *job, char **argv, int *err, const char **what) {
+	volatile int exec_err = 0;
+	const char *volatile failed = "vfork";
+	sigset_t all, old;
+	unsigned i;
+	pid_t pid;
+
+	/* no handler of ours may run in the child while it shares our memory */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pid = vfork();
+	if(pid == 0) {
+		signal(SIGCHLD, SIG_DFL);
+		signal(SIGUSR1, SIG_DFL);
+		for(i = 0; i < job->nfa; i++) {
+			spawn_action *a = &job->fa[i];
+			int fd;
+			switch(a->op) {
+			case FA_CLOSE:
+				close(a->fd);
+				break;
+			case FA_DUP2:
+				failed = "dup2";
+				if(dup2(a->src, a->fd) == -1) goto fail;
+				break;
+			case FA_OPEN:
+				failed = a->path;
+				fd = open(a->path, a->flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+				if(fd == -1) goto fail;
+				if(fd != a->fd) {
+					if(dup2(fd, a->fd) == -1) goto fail;
+					close(fd);
+				}
+				break;
+			}
+		}
+		if(prog_state.limits) {
+			limit_rec* limit;
+			failed = "setrlimit";
+			sblist_iter(prog_state.limits, limit)
+				if(setrlimit(limit->limit, &limit->rl) == -1) goto fail;
+		}
+		sigprocmask(SIG_SETMASK, &old, NULL);
+		failed = argv[0];
+		execvp(argv[0], argv);
+		fail:
+		exec_err = errno;
+		_exit(127);
+	}
+	*err = pid == -1 ? errno : exec_err;
+	*what = failed;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return pid;
+}
+
+/* -spawners: the dispatcher prepares the job and hands the slot to a
+   spawner thread, which does the vfork/exec while the dispatcher goes on
+   with the next line. until the thread stored the pid, the slot has pid
+   0. reap_child() waits for that if it reaps a pid it doesn't know yet. */
+static struct {
+	pthread_t *threads;
+	pthread_mutex_t mtx;
+	pthread_cond_t work, done;
+	size_t *queue, qhead, qcount, pending;
+	sblist *failed; /* slots whose vfork failed */
+	bool stop;
+} spawners = {.mtx = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER,
+              .done = PTHREAD_COND_INITIALIZER};
+
+static void* spawner_thread(void *arg) {
+	char *argv[4096];
+	(void) arg;
+	pthread_mutex_lock(&spawners.mtx);
+	while(1) {
+		while(!spawners.qcount && !spawners.stop)
+			pthread_cond_wait(&spawners.work, &spawners.mtx);
+		if(!spawners.qcount) break;
+		size_t i = spawners.queue[spawners.qhead];
+		spawners.qhead = (spawners.qhead + 1) % prog_state.numthreads;
+		spawners.qcount--;
+		pthread_mutex_unlock(&spawners.mtx);
+
+		job_info *job = sblist_get(prog_state.job_infos, i);
+		const char *what;
+		int err;
+		unpack_argv(job->spawn_argv, argv, ARRAY_SIZE(argv));
+		pid_t pid = spawn_job(job, argv, &err, &what);
+		/* a failed exec makes the job exit with 127 */
+		if(err) dprintf(2, "%s: %s\n", what, strerror(err));
+		if(job->spawn_close[0] != -1) close(job->spawn_close[0]);
+		if(job->spawn_close[1] != -1) close(job->spawn_close[1]);
+
+		if(pid != -1) PROBE3(job_spawned, i, pid, job->lineno);
+		pthread_mutex_lock(&spawners.mtx);
+		if(pid == -1) sblist_add(spawners.failed, &i);
+		else job->pid = pid;
+		spawners.pending--;
+		pthread_cond_broadcast(&spawners.done);
+	}
+	pthread_mutex_unlock(&spawners.mtx);
+	return 0;
+}
+
+static void spawners_start(void) {
+	size_t i;
+	spawners.threads = calloc(prog_state.spawners, sizeof(pthread_t));
+	spawners.queue = calloc(prog_state.numthreads, sizeof(size_t));
+	spawners.failed = sblist_new(sizeof(size_t), 16);
+	if(!spawners.threads || !spawners.queue || !spawners.failed)
+		die("out of memory\n");
+	for(i = 0; i < prog_state.spawners; i++)
+		if(pthread_create(&spawners.threads[i], 0, spawner_thread, 0))
+			die("could not create spawner thread\n");
+}
+
+static void spawners_stop(void) {
+	size_t i;
+	pthread_mutex_lock(&spawners.mtx);
+	spawners.stop = 1;
+	pthread_cond_broadcast(&spawners.work);
+	pthread_mutex_unlock(&spawners.mtx);
+	for(i = 0; i < prog_state.spawners; i++)
+		pthread_join(spawners.threads[i], 0);
+	free(spawners.threads);
+	free(spawners.queue);
+	sblist_free(spawners.failed);
+}
+
+static void spawn_async(size_t jobindex, char **argv) {
+	job_info *job = sblist_get(prog_state.job_infos, jobindex);
+	free(job->spawn_argv);
+	if(!(job->spawn_argv = pack_argv(argv))) die("out of memory\n");
+	job->pid = 0;
+	pthread_mutex_lock(&spawners.mtx);
+	spawners.queue[(spawners.qhead + spawners.qcount++) % prog_state.numthreads] = jobindex;
+	spawners.pending++;
+	pthread_cond_signal(&spawners.work);
+	pthread_mutex_unlock(&spawners.mtx);
+}
+
+static void rate_launch(void);
+
 static void launch_job(size_t jobindex, char** argv) {
 	char stdout_filename_buf[256];
 	char stderr_filename_buf[256];
 	job_info* job = sblist_get(prog_state.job_infos, jobindex);
+	uint64_t t = trace_now();
+	const int wflags = O_WRONLY | O_CREAT | O_TRUNC;
 
 	if(job->pid != -1) return;
 
+	if(prog_state.rate) rate_launch();
+
 	if(prog_state.buffered) {
 		if((!makeLogfilename(stdout_filename_buf, sizeof(stdout_filename_buf), jobindex, 0)) ||
 		   ((!prog_state.join_output) && !makeLogfilename(stderr_filename_buf, sizeof(stderr_filename_buf), jobindex, 1)) ) {
@@ -201,86 +691,590 @@ static void launch_job(size_t jobindex, char** argv) {
 		}
 	}
 
-	errno = posix_spawn_file_actions_init(&job->fa);
-	if(errno) goto spawn_error;
-
-	errno = posix_spawn_file_actions_addclose(&job->fa, 0);
-	if(errno) goto spawn_error;
+	fa_free(job);
+	fa_add(job, FA_CLOSE, 0, 0, 0, 0);
 
-	int pipes[2];
+	int pipes[2] = {-1, -1}, outpipe[2] = {-1, -1}, err = 0;
+	const char *what = 0;
 	if(prog_state.pipe_mode) {
-		if(pipe(pipes)) {
+		/* cloexec, so other jobs don't keep the pipe open after we close it */
+		if(pipe2(pipes, O_CLOEXEC)) {
 			perror("pipe");
 			goto spawn_error;
 		}
 		job->pipe = pipes[1];
-		errno = posix_spawn_file_actions_adddup2(&job->fa, pipes[0], 0);
-		if(errno) goto spawn_error;
-		errno = posix_spawn_file_actions_addclose(&job->fa, pipes[0]);
-		if(errno) goto spawn_error;
-		errno = posix_spawn_file_actions_addclose(&job->fa, pipes[1]);
-		if(errno) goto spawn_error;
+		fa_add(job, FA_DUP2, 0, pipes[0], 0, 0);
+		fa_add(job, FA_CLOSE, pipes[0], 0, 0, 0);
+		fa_add(job, FA_CLOSE, pipes[1], 0, 0, 0);
 	}
 
 	if(prog_state.buffered) {
-		errno = posix_spawn_file_actions_addclose(&job->fa, 1);
-		if(errno) goto spawn_error;
-		errno = posix_spawn_file_actions_addclose(&job->fa, 2);
-		if(errno) goto spawn_error;
+		fa_add(job, FA_CLOSE, 1, 0, 0, 0);
+		fa_add(job, FA_CLOSE, 2, 0, 0, 0);
 	}
 
-	if(!prog_state.pipe_mode) {
-		errno = posix_spawn_file_actions_addopen(&job->fa, 0, "/dev/null", O_RDONLY, 0);
-		if(errno) goto spawn_error;
-	}
+	if(!prog_state.pipe_mode)
+		fa_add(job, FA_OPEN, 0, 0, "/dev/null", O_RDONLY);
 
 	if(prog_state.buffered) {
-		errno = posix_spawn_file_actions_addopen(&job->fa, 1, stdout_filename_buf, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-		if(errno) goto spawn_error;
+		fa_add(job, FA_OPEN, 1, 0, stdout_filename_buf, wflags);
 		if(prog_state.join_output)
-			errno = posix_spawn_file_actions_adddup2(&job->fa, 1, 2);
+			fa_add(job, FA_DUP2, 2, 1, 0, 0);
+		else
+			fa_add(job, FA_OPEN, 2, 0, stderr_filename_buf, wflags);
+	}
+
+	if(prog_state.out_template)
+		fa_add(job, FA_OPEN, 1, 0, prog_state.out_path, wflags);
+	if(prog_state.err_template) {
+		if(prog_state.out_template && !strcmp(prog_state.out_path, prog_state.err_path))
+			fa_add(job, FA_DUP2, 2, 1, 0, 0);
 		else
-			errno = posix_spawn_file_actions_addopen(&job->fa, 2, stderr_filename_buf, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-		if(errno) goto spawn_error;
+			fa_add(job, FA_OPEN, 2, 0, prog_state.err_path, wflags);
+	}
+
+	if(capture_output()) {
+		if(pipe2(outpipe, O_CLOEXEC)) {
+			perror("pipe");
+			goto spawn_error;
+		}
+		fa_add(job, FA_DUP2, 1, outpipe[1], 0, 0);
+		if(prog_state.join_output)
+			fa_add(job, FA_DUP2, 2, outpipe[1], 0, 0);
 	}
 
-	errno = posix_spawnp(&job->pid, argv[0], &job->fa, NULL, argv, environ);
-	if(errno) {
+	job->lineno = prog_state.launch_lineno;
+	job->started = now_ms();
+	if(prog_state.spawners) {
+		job->spawn_close[0] = pipes[0];
+		job->spawn_close[1] = outpipe[1];
+		outpipe[1] = pipes[0] = -1;
+		spawn_async(jobindex, argv);
+	} else if(!prog_state.limits)
+		job->pid = spawn_posix(job, argv, &err, &what);
+	else if((job->pid = spawn_job(job, argv, &err, &what)) != -1 && err) {
+		/* the exec failed, the child is gone */
+		waitpid(job->pid, 0, 0);
+		job->pid = -1;
+	}
+	if(job->pid == -1) {
+		if(err) dprintf(2, "%s: %s\n", what, strerror(err));
 		spawn_error:
 		job->pid = -1;
-		perror("posix_spawn");
 	} else {
 		prog_state.threads_running++;
-		if(prog_state.limits) {
-			limit_rec* limit;
-			sblist_iter(prog_state.limits, limit) {
-				if(prlimit(job->pid, limit->limit, &limit->rl, NULL) == -1)
-					perror("prlimit");
+		prog_state.jobs_started++;
+		if(!prog_state.spawners)
+			PROBE3(job_spawned, jobindex, job->pid, job->lineno);
+		job->cache_key = prog_state.cache_key;
+		job->cache_check = prog_state.cache_check;
+		job->trace_start = trace_now();
+		if(prog_state.speculate) {
+			free(job->args);
+			job->args = pack_argv(argv);
+		}
+		if(capture_output()) {
+			fcntl(outpipe[0], F_SETFL, O_NONBLOCK);
+			fcntl(job->pipe, F_SETFL, O_NONBLOCK);
+			job->out = outpipe[0];
+			job->ostart = job->olen = 0;
+			outpipe[0] = -1;
+			if(prog_state.merge) {
+				job->mstate = MS_WAIT;
+				merge_waiting++;
 			}
 		}
 	}
-	if(prog_state.pipe_mode)
-		close(pipes[0]);
+	if(outpipe[0] != -1) close(outpipe[0]);
+	if(outpipe[1] != -1) close(outpipe[1]);
+	if(pipes[0] != -1) close(pipes[0]);
+	if(job->pid == -1 && pipes[1] != -1) {
+		close(pipes[1]);
+		job->pipe = -1;
+	}
+	trace_end(TR_SPAWN, t, jobindex);
+}
+
+/* -uring: do the dispatcher's bulk i/o through an io_uring, so most of it
+   takes one io_uring_enter() per input chunk instead of a syscall per
+   operation. a regular file on stdin is read with URING_READS reads in
+   flight into registered buffers, the lines passed on in pipe mode are
+   collected per child and written with one writev op each per chunk,
+   -buffered output is copied with linked read/write pairs, and children
+   are reaped with waitid ops. everything takes the usual path if jobflow
+   was built without the header, or the kernel doesn't allow io_uring. */
+#define URING_ENTRIES 256
+#define URING_READS 4
+#define URING_IOV 256 /* lines per child and writev */
+#define URING_COPY_BUF (64*1024)
+#define URING_MAX_FIXED (64*1024*1024) /* don't pin bigger input buffers */
+
+#ifdef HAVE_URING
+#define URING_OP_WAITID 50 /* linux 6.7, newer than some headers */
+enum uring_tag { UR_READ = 1, UR_WRITE, UR_COPY, UR_WAITID };
+#define UR_DATA(tag, i) ((uint64_t) (tag) << 32 | (i))
+enum uring_rstate { RS_IDLE = 0, RS_BUSY, RS_DONE };
+
+static struct {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_array, sq_mask, entries;
+	unsigned *cq_head, *cq_tail, cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *ring;
+	size_t ring_size;
+	unsigned queued, inflight;
+	unsigned long long enters, ops;
+	bool batch; /* the lines passed to pass_stdin() stay valid until uring_flush() */
+	bool no_waitid;
+	/* pipe mode writes, up to URING_IOV per child */
+	struct iovec *iov;
+	unsigned *niov, *ioff;
+	unsigned char *wbusy;
+	size_t writing;
+	/* input reads */
+	int rfd;
+	char *rmem;
+	size_t rsize, want;
+	bool fixed;
+	off_t next, pos, roff[URING_READS];
+	int rres[URING_READS];
+	unsigned char rstate[URING_READS];
+	/* output copies */
+	char *copy_buf;
+	uint64_t copy_size, copy_done;
+	unsigned copy_pending;
+	bool copy_failed;
+	/* waitid */
+	int wait_res;
+	bool wait_done;
+} uring = {.fd = -1};
+
+static void uring_init(void) {
+	struct io_uring_params p;
+	int fd;
+	memset(&p, 0, sizeof p);
+	if((fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) == -1)
+		return;
+	/* the sq and cq rings share one mapping since linux 5.4 */
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	uring.ring_size = sq_size > cq_size ? sq_size : cq_size;
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP)) goto fail;
+	uring.ring = mmap(0, uring.ring_size, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if(uring.ring == MAP_FAILED) goto fail;
+	uring.sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if(uring.sqes == MAP_FAILED) {
+		munmap(uring.ring, uring.ring_size);
+		goto fail;
+	}
+	char *r = uring.ring;
+	uring.sq_head = (unsigned*) (r + p.sq_off.head);
+	uring.sq_tail = (unsigned*) (r + p.sq_off.tail);
+	uring.sq_mask = *(unsigned*) (r + p.sq_off.ring_mask);
+	uring.sq_array = (unsigned*) (r + p.sq_off.array);
+	uring.entries = p.sq_entries;
+	uring.cq_head = (unsigned*) (r + p.cq_off.head);
+	uring.cq_tail = (unsigned*) (r + p.cq_off.tail);
+	uring.cq_mask = *(unsigned*) (r + p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe*) (r + p.cq_off.cqes);
+	uring.fd = fd;
+	if(prog_state.pipe_mode) {
+		size_t n = prog_state.numthreads;
+		uring.iov = calloc(n * URING_IOV, sizeof(struct iovec));
+		uring.niov = calloc(n, sizeof(unsigned));
+		uring.ioff = calloc(n, sizeof(unsigned));
+		uring.wbusy = calloc(n, 1);
+		if(!uring.iov || !uring.niov || !uring.ioff || !uring.wbusy)
+			die("out of memory\n");
+	}
+	if(prog_state.buffered && !(uring.copy_buf = malloc(URING_COPY_BUF)))
+		die("out of memory\n");
+	return;
+	fail:
+	close(fd);
+}
+
+static void uring_exit(void) {
+	if(uring.fd == -1) return;
+	munmap(uring.sqes, uring.entries * sizeof(struct io_uring_sqe));
+	munmap(uring.ring, uring.ring_size);
+	close(uring.fd);
+	uring.fd = -1;
+	free(uring.iov);
+	free(uring.niov);
+	free(uring.ioff);
+	free(uring.wbusy);
+	free(uring.copy_buf);
 }
 
+/* submit the queued sqes, and wait for min_complete completions */
+static void uring_enter(unsigned min_complete) {
+	int n;
+	do n = syscall(__NR_io_uring_enter, uring.fd, uring.queued, min_complete,
+	               min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	while(n == -1 && errno == EINTR);
+	if(n == -1) {
+		/* EBUSY: the kernel wants the completions reaped first */
+		if(errno == EBUSY || errno == EAGAIN) return;
+		perror("io_uring_enter");
+		exit(1);
+	}
+	uring.enters++;
+	uring.queued -= n;
+	uring.inflight += n;
+}
+
+static void uring_write_done(size_t i, int res);
+
+static void uring_complete(uint64_t data, int res) {
+	unsigned i = data & 0xffffffff;
+	switch(data >> 32) {
+	case UR_READ:
+		uring.rres[i] = res;
+		uring.rstate[i] = RS_DONE;
+		break;
+	case UR_WRITE:
+		uring_write_done(i, res);
+		break;
+	case UR_COPY: {
+		/* ops 2k and 2k+1 read and write the k-th block. they complete
+		   in order, as every op of a copy is linked to the one before. */
+		uint64_t want = uring.copy_size - (uint64_t) (i >> 1) * URING_COPY_BUF;
+		if(want > URING_COPY_BUF) want = URING_COPY_BUF;
+		uring.copy_pending--;
+		if((i & 1) && !uring.copy_failed && res > 0) uring.copy_done += res;
+		if(res < 0 || (uint64_t) res != want) uring.copy_failed = 1;
+		break;
+	}
+	case UR_WAITID:
+		uring.wait_res = res;
+		uring.wait_done = 1;
+		break;
+	}
+}
+
+static void uring_reap(void) {
+	unsigned head = *uring.cq_head;
+	while(head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+		uring_complete(cqe->user_data, cqe->res);
+		head++;
+		uring.inflight--;
+		uring.ops++;
+	}
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* submit the queued sqes and process completions until cond is met */
+static void uring_wait(int (*cond)(void)) {
+	while(1) {
+		uring_reap();
+		if(cond()) break;
+		assert(uring.queued + uring.inflight);
+		uring_enter(1);
+	}
+}
+
+static int uring_has_room(void) {
+	return uring.queued + uring.inflight < uring.entries;
+}
+
+/* get a zeroed sqe, which is submitted with the next uring_enter().
+   in flight ops are bounded by the sq size, so the cq can't overflow. */
+static struct io_uring_sqe* uring_sqe(void) {
+	if(!uring_has_room()) {
+		if(uring.queued) uring_enter(0);
+		uring_wait(uring_has_room);
+	}
+	unsigned tail = *uring.sq_tail, idx = tail & uring.sq_mask;
+	struct io_uring_sqe *sqe = &uring.sqes[idx];
+	memset(sqe, 0, sizeof *sqe);
+	uring.sq_array[idx] = idx;
+	__atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	uring.queued++;
+	return sqe;
+}
+
+/* input reads. slot i's data goes to rmem + (2*i+1) * rsize, the rsize
+   bytes in front of it are for the tail of the previous chunk, see
+   split_input(). the slots are filled in order with consecutive chunks
+   of the file. */
+static size_t uring_reads(int fd) {
+	struct stat st;
+	if(uring.fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+		return 1;
+	return URING_READS;
+}
+
+static void uring_reads_begin(int fd, char *mem, size_t chunksize) {
+	struct iovec iov[URING_READS];
+	size_t i;
+	uring.rfd = fd;
+	uring.rmem = mem;
+	uring.rsize = chunksize;
+	uring.next = uring.pos = lseek(fd, 0, SEEK_CUR);
+	if(uring.next == -1) uring.next = uring.pos = 0;
+	memset(uring.rstate, RS_IDLE, sizeof uring.rstate);
+	for(i = 0; i < URING_READS; i++)
+		iov[i] = (struct iovec) {.iov_base = mem + (2*i+1) * chunksize, .iov_len = chunksize};
+	uring.fixed = chunksize * URING_READS <= URING_MAX_FIXED &&
+		!syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS, iov, URING_READS);
+}
+
+static int uring_no_reads(void) {
+	size_t i;
+	for(i = 0; i < URING_READS; i++)
+		if(uring.rstate[i] == RS_BUSY) return 0;
+	return 1;
+}
+
+static int uring_read_done(void) {
+	return uring.rstate[uring.want] == RS_DONE;
+}
+
+/* return the data read into slot i, like read(). the slot before it was
+   consumed, so it is filled with the next chunk to read. */
+static ssize_t uring_read(size_t slot) {
+	size_t i, s = (slot + URING_READS - 1) % URING_READS;
+	if(uring.rstate[s] == RS_DONE) uring.rstate[s] = RS_IDLE;
+	for(i = 0; i < URING_READS; i++) {
+		s = (slot + i) % URING_READS;
+		if(uring.rstate[s] != RS_IDLE) continue;
+		struct io_uring_sqe *sqe = uring_sqe();
+		sqe->opcode = uring.fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+		sqe->fd = uring.rfd;
+		sqe->addr = (uintptr_t) (uring.rmem + (2*s+1) * uring.rsize);
+		sqe->len = uring.rsize;
+		sqe->off = uring.next;
+		sqe->buf_index = s;
+		sqe->user_data = UR_DATA(UR_READ, s);
+		uring.roff[s] = uring.next;
+		uring.next += uring.rsize;
+		uring.rstate[s] = RS_BUSY;
+	}
+	uring.want = slot;
+	uring_wait(uring_read_done);
+	int res = uring.rres[slot];
+	if(res < 0) {
+		errno = -res;
+		return -1;
+	}
+	uring.pos = uring.roff[slot] + res;
+	if((size_t) res < uring.rsize) {
+		/* end of file, or it was still being written. the reads behind
+		   this one are of no use, continue after what we got. */
+		uring_wait(uring_no_reads);
+		for(i = 0; i < URING_READS; i++)
+			if(i != slot) uring.rstate[i] = RS_IDLE;
+		uring.next = uring.pos;
+	}
+	return res;
+}
+
+static void uring_reads_end(void) {
+	uring_wait(uring_no_reads);
+	if(uring.fixed)
+		syscall(__NR_io_uring_register, uring.fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+	/* leave stdin where the consumed input ends, like read() would */
+	lseek(uring.rfd, uring.pos, SEEK_SET);
+}
+
+/* pipe mode: queue line for the child in slot i. it's written by
+   uring_flush(), so the line must stay valid until then. */
+static void uring_flush(void);
+static void uring_write(size_t i, char *line, size_t len) {
+	struct iovec *iov = uring.iov + i * URING_IOV;
+	unsigned n = uring.niov[i];
+	if(n && (char*) iov[n-1].iov_base + iov[n-1].iov_len == line) {
+		iov[n-1].iov_len += len;
+		return;
+	}
+	if(n == URING_IOV) {
+		uring_flush();
+		n = 0;
+	}
+	iov[n] = (struct iovec) {.iov_base = line, .iov_len = len};
+	uring.niov[i] = n + 1;
+}
+
+static void uring_write_done(size_t i, int res) {
+	struct iovec *iov = uring.iov + i * URING_IOV;
+	uring.wbusy[i] = 0;
+	uring.writing--;
+	if(res < 0) {
+		errno = -res;
+		perror("write");
+		uring.niov[i] = uring.ioff[i] = 0;
+		return;
+	}
+	/* a short write is continued by uring_flush() */
+	while(uring.ioff[i] < uring.niov[i] && (size_t) res >= iov[uring.ioff[i]].iov_len)
+		res -= iov[uring.ioff[i]++].iov_len;
+	if(uring.ioff[i] == uring.niov[i])
+		uring.niov[i] = uring.ioff[i] = 0;
+	else {
+		iov[uring.ioff[i]].iov_base = (char*) iov[uring.ioff[i]].iov_base + res;
+		iov[uring.ioff[i]].iov_len -= res;
+	}
+}
+
+static int uring_writes_done(void) {
+	return !uring.writing;
+}
+
+/* write the queued lines, with one writev op per child */
+static void uring_flush(void) {
+	size_t i, n = sblist_getsize(prog_state.job_infos), todo;
+	uint64_t t = trace_now();
+	do {
+		for(todo = 0, i = 0; i < n; i++) {
+			if(uring.niov[i] == uring.ioff[i] || uring.wbusy[i]) continue;
+			job_info *job = sblist_get(prog_state.job_infos, i);
+			struct io_uring_sqe *sqe = uring_sqe();
+			sqe->opcode = IORING_OP_WRITEV;
+			sqe->fd = job->pipe;
+			sqe->addr = (uintptr_t) (uring.iov + i * URING_IOV + uring.ioff[i]);
+			sqe->len = uring.niov[i] - uring.ioff[i];
+			sqe->off = -1;
+			sqe->user_data = UR_DATA(UR_WRITE, i);
+			uring.wbusy[i] = 1;
+			uring.writing++;
+			todo++;
+		}
+		if(todo) uring_wait(uring_writes_done);
+	} while(todo);
+	trace_end(TR_WRITE, t, n);
+}
+
+static int uring_copy_done(void) {
+	return !uring.copy_pending;
+}
+
+/* copy size bytes of the file in to out with linked read/write pairs.
+   returns the number of bytes copied, which is less than size if a read
+   or write was short. */
+static uint64_t uring_copy(int in, int out, uint64_t size) {
+	uint64_t off = 0;
+	uring.copy_size = size;
+	uring.copy_done = 0;
+	uring.copy_failed = 0;
+	while(off < size && !uring.copy_failed) {
+		/* a chain must be submitted as a whole */
+		if(uring.queued) uring_enter(0);
+		while(uring.entries - uring.inflight < 2) {
+			uring_enter(1);
+			uring_reap();
+		}
+		unsigned pairs = (uring.entries - uring.inflight) / 2;
+		while(pairs-- && off < size) {
+			unsigned k = off / URING_COPY_BUF, len = size - off > URING_COPY_BUF ? URING_COPY_BUF : size - off;
+			struct io_uring_sqe *sqe = uring_sqe();
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = in;
+			sqe->addr = (uintptr_t) uring.copy_buf;
+			sqe->len = len;
+			sqe->off = off;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = UR_DATA(UR_COPY, 2*k);
+			sqe = uring_sqe();
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->fd = out;
+			sqe->addr = (uintptr_t) uring.copy_buf;
+			sqe->len = len;
+			sqe->off = -1;
+			sqe->flags = pairs && off + len < size ? IOSQE_IO_LINK : 0;
+			sqe->user_data = UR_DATA(UR_COPY, 2*k+1);
+			uring.copy_pending += 2;
+			off += len;
+		}
+		uring_wait(uring_copy_done);
+	}
+	return uring.copy_done;
+}
+
+static int uring_wait_done(void) {
+	return uring.wait_done;
+}
+
+/* waitpid(-1, status, 0) as a waitid op. returns 0 if the kernel doesn't
+   know the op, so the caller uses waitpid() instead. */
+static pid_t uring_waitpid(int *status) {
+	siginfo_t si;
+	struct io_uring_sqe *sqe = uring_sqe();
+	memset(&si, 0, sizeof si);
+	sqe->opcode = URING_OP_WAITID;
+	sqe->len = P_ALL;
+	sqe->file_index = WEXITED;
+	sqe->addr2 = (uintptr_t) &si;
+	sqe->user_data = UR_DATA(UR_WAITID, 0);
+	uring.wait_done = 0;
+	uring_wait(uring_wait_done);
+	if(uring.wait_res == -EINVAL) {
+		uring.no_waitid = 1;
+		return 0;
+	}
+	if(uring.wait_res < 0) {
+		errno = -uring.wait_res;
+		return -1;
+	}
+	if(si.si_code == CLD_EXITED)
+		*status = (si.si_status & 0xff) << 8;
+	else
+		*status = (si.si_status & 0x7f) | (si.si_code == CLD_DUMPED ? 0x80 : 0);
+	return si.si_pid;
+}
+#else
+static struct {
+	int fd;
+	bool batch, no_waitid;
+	unsigned long long enters, ops;
+} uring = {.fd = -1};
+static void uring_init(void) {}
+static void uring_exit(void) {}
+static size_t uring_reads(int fd) { (void) fd; return 1; }
+static void uring_reads_begin(int fd, char *mem, size_t chunksize) { (void) fd; (void) mem; (void) chunksize; }
+static ssize_t uring_read(size_t slot) { (void) slot; return -1; }
+static void uring_reads_end(void) {}
+static void uring_write(size_t i, char *line, size_t len) { (void) i; (void) line; (void) len; }
+static void uring_flush(void) {}
+static uint64_t uring_copy(int in, int out, uint64_t size) { (void) in; (void) out; (void) size; return 0; }
+static pid_t uring_waitpid(int *status) { (void) status; return 0; }
+#endif
+
 static void dump_output(size_t job_id, int is_stderr) {
 	char out_filename_buf[256];
 	char buf[4096];
 	FILE* dst, *out_stream = is_stderr ? stderr : stdout;
 	size_t nread;
+	uint64_t t = trace_now();
 
 	makeLogfilename(out_filename_buf, sizeof(out_filename_buf), job_id, is_stderr);
 
 	dst = fopen(out_filename_buf, "r");
+	if(dst && uring.fd != -1) {
+		struct stat st;
+		uint64_t done = 0;
+		fflush(out_stream);
+		if(!fstat(fileno(dst), &st))
+			done = uring_copy(fileno(dst), fileno(out_stream), st.st_size);
+		/* the rest, if the copy was cut short */
+		fseeko(dst, done, SEEK_SET);
+	}
 	if(dst) {
 		while((nread = fread(buf, 1, sizeof(buf), dst))) {
 			fwrite(buf, 1, nread, out_stream);
 			if(nread < sizeof(buf)) break;
 		}
+		/* the position is all that was copied */
+		PROBE3(output_dumped, job_id, is_stderr, ftello(dst));
 		fclose(dst);
 		fflush(out_stream);
 		unlink(out_filename_buf);
 	}
+	trace_end(TR_DUMP, t, job_id);
 }
 
 static void write_all(int fd, void* buf, size_t size) {
@@ -303,85 +1297,915 @@ static void write_all(int fd, void* buf, size_t size) {
 	}
 }
 
-static void pass_stdin(char *line, size_t len) {
-	static size_t next_child = 0;
-	if(next_child >= sblist_getsize(prog_state.job_infos))
-		next_child = 0;
-	job_info *job = sblist_get(prog_state.job_infos, next_child);
-	write_all(job->pipe, line, len);
-	next_child++;
+static size_t count_linefeeds(const char *buf, size_t len) {
+	const char *p = buf, *e = buf+len;
+	size_t cnt = 0;
+	while(p < e) {
+		if(*p == '\n') cnt++;
+		p++;
+	}
+	return cnt;
 }
 
-static void close_pipes(void) {
-	size_t i;
-	for(i = 0; i < sblist_getsize(prog_state.job_infos); i++) {
-		job_info *job = sblist_get(prog_state.job_infos, i);
-		close(job->pipe);
-	}
+static inline int islb(int p) { return p == '\n' || p == '\r'; }
+static void chomp(char *s, size_t *len) {
+	while(*len && islb(s[*len-1])) s[--(*len)] = 0;
 }
 
-/* wait till a child exits, reap it, and return its job index for slot reuse */
-static size_t reap_child(int *retval) {
-	size_t i;
-	job_info* job;
-	int ret;
+/* input records end with the -rs separator, a line break unless -0 or
+   -rs was given, or are -recsize bytes long. */
+static int rs_is_lf(void) {
+	return prog_state.rs_len == 1 && prog_state.rs[0] == '\n';
+}
 
-	do ret = waitpid(-1, retval, 0);
-	while(ret == -1 && errno == EINTR);
-	if(ret == -1) abort();
+/* return the end of the first complete record in buf (past its
+   separator), or NULL if there is none */
+static char* rec_next(const char *buf, size_t len) {
+	const char *p;
+	if(prog_state.recsize)
+		return len >= prog_state.recsize ? (char*) buf + prog_state.recsize : 0;
+	if(prog_state.rs_len == 1) p = memchr(buf, prog_state.rs[0], len);
+	else p = memmem(buf, len, prog_state.rs, prog_state.rs_len);
+	return p ? (char*) p + prog_state.rs_len : 0;
+}
 
-	for(i = 0; i < sblist_getsize(prog_state.job_infos); i++) {
-		job = sblist_get(prog_state.job_infos, i);
-		if(job->pid == ret) {
-			job->pid = -1;
-			posix_spawn_file_actions_destroy(&job->fa);
-			prog_state.threads_running--;
-			if(prog_state.buffered) {
-				dump_output(i, 0);
-				if(!prog_state.join_output)
-					dump_output(i, 1);
-			}
-			return i;
-		}
+/* return the end of the last complete record in buf, or NULL */
+static char* rec_last(const char *buf, size_t len) {
+	size_t rl = prog_state.rs_len;
+	if(prog_state.recsize) {
+		len -= len % prog_state.recsize;
+		return len ? (char*) buf + len : 0;
 	}
-	assert(0);
-	return -1;
+	/* find the last byte of the separator, then check the rest */
+	while(len >= rl) {
+		const char *p = memrchr(buf + rl - 1, prog_state.rs[rl - 1], len - (rl - 1));
+		if(!p) break;
+		if(!memcmp(p - (rl - 1), prog_state.rs, rl)) return (char*) p + 1;
+		len = p - buf;
+	}
+	return 0;
 }
 
-static size_t free_slots(void) {
-	return prog_state.numthreads - prog_state.threads_running;
+static size_t count_records(const char *buf, size_t len) {
+	const char *p = buf, *e = buf + len;
+	size_t cnt = 0;
+	if(prog_state.recsize) return len / prog_state.recsize;
+	if(rs_is_lf()) return count_linefeeds(buf, len);
+	while((p = rec_next(p, e - p))) cnt++;
+	return cnt;
 }
 
-#define die(...) do { dprintf(2, "error: " __VA_ARGS__); exit(1); } while(0)
+/* the length of record without its separator, and with line breaks
+   without a trailing carriage return */
+static size_t rec_len(const char *rec, size_t len) {
+	size_t rl = prog_state.rs_len;
+	if(rs_is_lf()) {
+		while(len && islb(rec[len-1])) len--;
+	} else if(rl && len >= rl && !memcmp(rec + len - rl, prog_state.rs, rl))
+		len -= rl;
+	return len;
+}
 
-static unsigned long parse_human_number(const char* num) {
-	unsigned long ret = 0;
-	static const unsigned long mul[] = {1024, 1024 * 1024, 1024 * 1024 * 1024};
-	const char* kmg = "KMG";
-	const char* kmgind, *p;
-	ret = atol(num);
-	p = num;
-	while(isdigit(*(++p)));
-	if(*p && (kmgind = strchr(kmg, *p)))
-		ret *= mul[kmgind - kmg];
-	return ret;
+/* strip the separator off a record to pass it as an argument. the result
+   is nul-terminated, for -recsize records in a copy. */
+static char* rec_chomp(char *rec, size_t *len) {
+	static char *copy;
+	if(rs_is_lf()) {
+		chomp(rec, len);
+		return rec;
+	}
+	if(prog_state.recsize) {
+		if(!copy && !(copy = malloc(prog_state.recsize + 1))) die("out of memory\n");
+		memcpy(copy, rec, *len);
+		copy[*len] = 0;
+		return copy;
+	}
+	*len = rec_len(rec, *len);
+	rec[*len] = 0;
+	return rec;
 }
 
-static int syntax(void) {
-	dprintf(2,
-		"jobflow " VERSION " (C) rofl0r\n"
-		"------------------------\n"
-		"this program is intended to be used as a recipient of another programs output.\n"
-		"it launches processes to which the current line can be passed as an argument\n"
-		"using {} for substitution (as in find -exec).\n"
-		"if no input substitution argument ({} or {.}) is provided, input is piped into\n"
+/* the size of the chunks split_input() reads, a multiple of -recsize */
+static size_t input_chunksize(void) {
+	size_t n = prog_state.bulk_bytes ? prog_state.bulk_bytes : 16*1024;
+	if(prog_state.recsize)
+		n = n < prog_state.recsize ? prog_state.recsize : n - n % prog_state.recsize;
+	return n;
+}
+
+/* return a pointer to the n-th (1-based) field of line and store its length
+   in flen, or return NULL if there are less fields. fields are separated by
+   the -delim character, or by runs of blanks if none was given. */
+static char* get_field(char *line, size_t len, unsigned long n, size_t *flen) {
+	char *p = line, *e = line + len, *s;
+	int d = prog_state.delim;
+	if(!n) return 0;
+	if(!d) while(p < e && isblank(*p)) p++;
+	while(1) {
+		if(!d && p >= e) return 0;
+		s = p;
+		if(d) while(p < e && *p != d) p++;
+		else while(p < e && !isblank(*p)) p++;
+		if(--n == 0) {
+			*flen = p - s;
+			return s;
+		}
+		if(p >= e) return 0;
+		p++;
+		if(!d) while(p < e && isblank(*p)) p++;
+	}
+}
+
+/* the field offsets of the current line for {N}, see jobflow_subst().
+   fields_reset() must be called when the line changes. */
+static jobflow_fields fields;
+
+static void fields_reset(void) {
+	fields.valid = 0;
+}
+
+/* 64bit FNV-1a, hash64_update() continues the hash h with more data */
+#define HASH64_INIT 0xcbf29ce484222325ULL
+static uint64_t hash64_update(uint64_t h, const void *data, size_t len) {
+	const unsigned char *p = data, *e = p + len;
+	while(p < e) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t hash64(const void *data, size_t len) {
+	return hash64_update(HASH64_INIT, data, len);
+}
+
+/* pick the worker owning the key of line, see -partition */
+static size_t partition_of(char *line, size_t len) {
+	char *key = line;
+	size_t klen;
+	len = rec_len(line, len);
+	if(prog_state.part_field) {
+		if(!(key = get_field(line, len, prog_state.part_field, &klen)))
+			klen = 0;
+	} else {
+		size_t start = prog_state.part_start - 1;
+		if(start > len) start = len;
+		key = line + start;
+		klen = len - start;
+		if(klen > prog_state.part_end - start) klen = prog_state.part_end - start;
+	}
+	return hash64(key, klen) % sblist_getsize(prog_state.job_infos);
+}
+
+static void write_child(job_info *job, char *buf, size_t len);
+static void stage_write(size_t i, char *line, size_t len);
+static void stage_flush_all(void);
+static void rate_bytes(size_t len);
+
+static void pass_stdin(char *line, size_t len) {
+	static size_t next_child = 0;
+	size_t target;
+	if(prog_state.part_field || prog_state.part_end) {
+		target = partition_of(line, len);
+	} else {
+		if(next_child >= sblist_getsize(prog_state.job_infos))
+			next_child = 0;
+		target = next_child++;
+	}
+	job_info *job = sblist_get(prog_state.job_infos, target);
+	if(prog_state.bwlimit) rate_bytes(len);
+	job->lines_in += prog_state.bulk_bytes ? count_records(line, len) : 1;
+	job->bytes_in += len;
+	if(prog_state.coalesce) {
+		stage_write(target, line, len);
+		return;
+	}
+	if(uring.batch) {
+		uring_write(target, line, len);
+		return;
+	}
+	uint64_t t = trace_now();
+	write_child(job, line, len);
+	trace_end(TR_WRITE, t, target);
+}
+
+static void close_pipes(void) {
+	size_t i;
+	stage_flush_all();
+	for(i = 0; i < sblist_getsize(prog_state.job_infos); i++) {
+		job_info *job = sblist_get(prog_state.job_infos, i);
+		close(job->pipe);
+	}
+}
+
+static int process_failed(int retval) {
+	return WIFSIGNALED(retval) ||
+	       (WIFEXITED(retval) && WEXITSTATUS(retval));
+}
+
+static void discard_output(size_t job_id) {
+	char fn[256];
+	if(makeLogfilename(fn, sizeof(fn), job_id, 0)) unlink(fn);
+	if(makeLogfilename(fn, sizeof(fn), job_id, 1)) unlink(fn);
+}
+
+static size_t free_slots(void) {
+	return prog_state.numthreads - prog_state.threads_running;
+}
+
+static size_t find_free_slot(void) {
+	size_t i;
+	for(i = 0; i < sblist_getsize(prog_state.job_infos); i++) {
+		job_info *job = sblist_get(prog_state.job_infos, i);
+		if(job->pid == -1) return i;
+	}
+	assert(0);
+	return -1;
+}
+
+/* speculative re-execution of stragglers.
+   we keep the runtimes of the last SPEC_SAMPLES successfully finished jobs,
+   and whenever a slot is idle and a job runs longer than -speculate times
+   the median, a second copy of it is started. the first copy to finish
+   wins, the other one is killed and its output thrown away. */
+#define SPEC_SAMPLES 1024
+#define SPEC_MIN_SAMPLES 8
+static struct {
+	unsigned ms[SPEC_SAMPLES];
+	unsigned long count;
+} job_times;
+
+static void record_runtime(job_info *job) {
+	long long d = now_ms() - job->started;
+	job_times.ms[job_times.count++ % SPEC_SAMPLES] = d > UINT32_MAX ? UINT32_MAX : d;
+}
+
+static int cmp_unsigned(const void *a, const void *b) {
+	unsigned x = *(const unsigned*)a, y = *(const unsigned*)b;
+	return (x > y) - (x < y);
+}
+
+static long long median_runtime(void) {
+	unsigned tmp[SPEC_SAMPLES];
+	size_t n = job_times.count < SPEC_SAMPLES ? job_times.count : SPEC_SAMPLES;
+	memcpy(tmp, job_times.ms, n * sizeof(unsigned));
+	qsort(tmp, n, sizeof(unsigned), cmp_unsigned);
+	return tmp[n/2];
+}
+
+/* launch copies of stragglers into idle slots, and return the number of
+   milliseconds until the next job becomes a candidate, or -1. */
+static int speculate(void) {
+	size_t i, n = sblist_getsize(prog_state.job_infos);
+	long long threshold, now, next = -1;
+	char* argv[4096];
+
+	if(job_times.count < SPEC_MIN_SAMPLES) return -1;
+	threshold = median_runtime() * prog_state.speculate;
+	if(threshold < 1) threshold = 1;
+	now = now_ms();
+
+	for(i = 0; i < n; i++) {
+		job_info *job = sblist_get(prog_state.job_infos, i);
+		/* a killed loser may take a while to exit, it's not copied again */
+		if(job->pid == -1 || job->twin != -1 || job->killed || !job->args) continue;
+		long long due = job->started + threshold;
+		if(due > now) {
+			if(next == -1 || due < next) next = due;
+			continue;
+		}
+		if(!free_slots()) return -1;
+		size_t slot = find_free_slot();
+		job_info *copy = sblist_get(prog_state.job_infos, slot);
+		unpack_argv(job->args, argv, ARRAY_SIZE(argv));
+		prog_state.launch_lineno = job->lineno;
+		prog_state.cache_key = job->cache_key;
+		prog_state.cache_check = job->cache_check;
+		launch_job(slot, argv);
+		if(copy->pid == -1) continue;
+		/* the job pointer may not move, the slot list never grows */
+		job->twin = slot;
+		copy->twin = i;
+	}
+	if(next == -1) return -1;
+	return next - now > INT32_MAX ? INT32_MAX : next - now;
+}
+
+/* self-pipe which gets written to on SIGCHLD, so we can wait for child
+   exits and other events at the same time. */
+static int sigchld_pipe[2] = {-1, -1};
+
+static void sigchld_handler(int sig) {
+	int e = errno;
+	(void) sig;
+	if(write(sigchld_pipe[1], "", 1) == -1) {}
+	errno = e;
+}
+
+static int need_event_loop(void) {
+	return prog_state.speculate || capture_output() || prog_state.trace ||
+	       prog_state.stream_specs || prog_state.rate || prog_state.bwlimit;
+}
+
+static void setup_event_loop(void) {
+	struct sigaction sa = {.sa_handler = sigchld_handler,
+	                       .sa_flags = SA_RESTART | SA_NOCLDSTOP};
+	if(pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+	prog_state.pfds = calloc(prog_state.numthreads + 2, sizeof(struct pollfd));
+	if(prog_state.merge)
+		merge_heap = calloc(prog_state.numthreads, sizeof(size_t));
+	if(!prog_state.pfds || (prog_state.merge && !merge_heap))
+		die("out of memory\n");
+}
+
+/* the trace is written by the dispatcher at its next event, the self-pipe
+   wakes it up if it's waiting for jobs. */
+static void sigusr1_handler(int sig) {
+	int e = errno;
+	(void) sig;
+	trace.dump = 1;
+	if(sigchld_pipe[1] != -1 && write(sigchld_pipe[1], "", 1) == -1) {}
+	errno = e;
+}
+
+static void trace_init(void) {
+	struct sigaction sa = {.sa_handler = sigusr1_handler, .sa_flags = SA_RESTART};
+	if(!(trace.ev = calloc(prog_state.trace_size, sizeof(trace_event))))
+		die("out of memory\n");
+	trace.t0 = trace_now();
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+/* k-way merge of the captured outputs. every job's output is a stream of
+   lines sorted by the merge key. the streams whose first line is complete
+   are kept in a heap, and the smallest line is written out as long as no
+   stream is still waiting for data. */
+static int merge_cmp(size_t a, size_t b) {
+	job_info *x = sblist_get(prog_state.job_infos, a);
+	job_info *y = sblist_get(prog_state.job_infos, b);
+	int r;
+	if(prog_state.merge_numeric)
+		r = (x->key_num > y->key_num) - (x->key_num < y->key_num);
+	else {
+		size_t l = x->key_len < y->key_len ? x->key_len : y->key_len;
+		r = memcmp(x->obuf + x->key_off, y->obuf + y->key_off, l);
+		if(!r) r = (x->key_len > y->key_len) - (x->key_len < y->key_len);
+	}
+	return r ? r : (a > b) - (a < b);
+}
+
+static void merge_push(size_t i) {
+	size_t n = merge_heap_n++;
+	while(n) {
+		size_t parent = (n - 1) / 2;
+		if(merge_cmp(merge_heap[parent], i) <= 0) break;
+		merge_heap[n] = merge_heap[parent];
+		n = parent;
+	}
+	merge_heap[n] = i;
+}
+
+static size_t merge_pop(void) {
+	size_t ret = merge_heap[0], last = merge_heap[--merge_heap_n], n = 0;
+	while(1) {
+		size_t c = n * 2 + 1;
+		if(c >= merge_heap_n) break;
+		if(c + 1 < merge_heap_n && merge_cmp(merge_heap[c + 1], merge_heap[c]) < 0) c++;
+		if(merge_cmp(last, merge_heap[c]) <= 0) break;
+		merge_heap[n] = merge_heap[c];
+		n = c;
+	}
+	if(merge_heap_n) merge_heap[n] = last;
+	return ret;
+}
+
+/* try to make the first line of a waiting stream its head. */
+static void merge_advance(size_t i) {
+	job_info *job = sblist_get(prog_state.job_infos, i);
+	char *line = job->obuf + job->ostart, *nl, *key;
+	size_t avail = job->olen - job->ostart, klen;
+
+	if(job->mstate != MS_WAIT) return;
+	nl = avail ? memchr(line, '\n', avail) : 0;
+	if(nl) job->head_len = (nl - line) + 1;
+	else if(job->out == -1 && avail) job->head_len = avail;
+	else {
+		if(job->out == -1) {
+			job->mstate = MS_DONE;
+			merge_waiting--;
+		}
+		return;
+	}
+	klen = nl ? job->head_len - 1 : job->head_len;
+	key = line;
+	if(prog_state.merge_key && !(key = get_field(line, klen, prog_state.merge_key, &klen))) {
+		key = line;
+		klen = 0;
+	}
+	if(prog_state.merge_numeric) {
+		char buf[64];
+		if(klen >= sizeof buf) klen = sizeof(buf) - 1;
+		memcpy(buf, key, klen);
+		buf[klen] = 0;
+		job->key_num = strtod(buf, 0);
+	}
+	job->key_off = key - job->obuf;
+	job->key_len = klen;
+	job->mstate = MS_HEAD;
+	merge_waiting--;
+	merge_push(i);
+}
+
+static void merge_emit(void) {
+	while(!merge_waiting && merge_heap_n) {
+		size_t i = merge_pop();
+		job_info *job = sblist_get(prog_state.job_infos, i);
+		fwrite(job->obuf + job->ostart, 1, job->head_len, stdout);
+		if(job->obuf[job->ostart + job->head_len - 1] != '\n')
+			fputc('\n', stdout);
+		job->ostart += job->head_len;
+		job->mstate = MS_WAIT;
+		merge_waiting++;
+		merge_advance(i);
+	}
+}
+
+/* -linebuffered: write out the complete lines of a job's output, each in
+   one piece. if final, also what's left of an unterminated last line.
+   a line longer than the buffer is passed on in parts, which may be
+   interleaved with the lines of other jobs. */
+#define LINEBUF_SIZE (64*1024)
+static void emit_lines(job_info *job, int final) {
+	char *p = job->obuf + job->ostart, *e = job->obuf + job->olen, *nl;
+	while(p < e) {
+		if(!(nl = memchr(p, '\n', e - p))) {
+			if(!final && (size_t)(e - p) < job->ocap) break;
+			nl = e - 1;
+		}
+		if(prog_state.tag && !job->opart) fprintf(stdout, "%llu\t", job->lineno);
+		fwrite(p, 1, nl + 1 - p, stdout);
+		job->opart = *nl != '\n';
+		p = nl + 1;
+	}
+	if(final && job->opart) {
+		fputc('\n', stdout);
+		job->opart = 0;
+	}
+	job->ostart = p - job->obuf;
+	if(job->ostart == job->olen) job->ostart = job->olen = 0;
+}
+
+/* read what's available from a job's captured stdout */
+static void read_output(size_t i) {
+	job_info *job = sblist_get(prog_state.job_infos, i);
+	ssize_t n;
+	/* a full buffer must make room, or read() would ask for 0 bytes and
+	   that be taken for EOF */
+	if(job->ostart && (job->ostart * 2 >= job->olen || job->olen == job->ocap)) {
+		memmove(job->obuf, job->obuf + job->ostart, job->olen - job->ostart);
+		if(job->mstate == MS_HEAD) job->key_off -= job->ostart;
+		job->olen -= job->ostart;
+		job->ostart = 0;
+	}
+	if(prog_state.line_output) {
+		/* fixed size, so a job producing output faster than we can
+		   write it out is slowed down by the pipe filling up. */
+		if(!job->obuf) {
+			if(!(job->obuf = malloc(LINEBUF_SIZE))) die("out of memory\n");
+			job->ocap = LINEBUF_SIZE;
+		}
+		/* a partial line filling all of it is passed on in parts */
+		if(job->olen == job->ocap) emit_lines(job, 0);
+	} else if(job->ocap - job->olen < 4096) {
+		size_t ncap = job->ocap ? job->ocap * 2 : 64*1024;
+		char *p = realloc(job->obuf, ncap);
+		if(!p) die("out of memory\n");
+		job->obuf = p;
+		job->ocap = ncap;
+	}
+	do n = read(job->out, job->obuf + job->olen, job->ocap - job->olen);
+	while(n == -1 && errno == EINTR);
+	if(n == -1) {
+		if(errno == EAGAIN) return;
+		perror("read");
+		n = 0;
+	}
+	if(n == 0) {
+		close(job->out);
+		job->out = -1;
+	}
+	job->olen += n;
+	if(prog_state.line_output) {
+		emit_lines(job, job->out == -1);
+		return;
+	}
+	merge_advance(i);
+	merge_emit();
+}
+
+/* called when a job exited, so its slot can be reused: pass on what's left
+   in the pipe. output of background processes the job left behind, which
+   still hold the pipe open, is lost. */
+static void finish_output(size_t i) {
+	job_info *job = sblist_get(prog_state.job_infos, i);
+	while(job->out != -1) {
+		size_t olen = job->olen;
+		read_output(i);
+		if(job->out != -1 && job->olen == olen) {
+			close(job->out);
+			job->out = -1;
+			emit_lines(job, 1);
+		}
+	}
+}
+
+/* once all input is passed on, a stream with a complete head line doesn't
+   need to be read from until it's merged, which bounds memory usage. */
+static int output_stalled(job_info *job) {
+	return prog_state.input_done && job->mstate == MS_HEAD &&
+	       job->olen - job->ostart >= 1024*1024;
+}
+
+/* sleep until either a child changed state, wfd became writable, or
+   timeout ms passed, while consuming captured output.
+   returns whether wfd is writable. */
+static int wait_event_us(long long timeout_us, int wfd) {
+	struct timespec ts = {.tv_sec = timeout_us / 1000000, .tv_nsec = timeout_us % 1000000 * 1000};
+	struct pollfd *pfd = prog_state.pfds;
+	size_t i, n = 0, first, nslots = sblist_getsize(prog_state.job_infos);
+	char buf[64];
+
+	pfd[n++] = (struct pollfd) {.fd = sigchld_pipe[0], .events = POLLIN};
+	pfd[n++] = (struct pollfd) {.fd = wfd, .events = POLLOUT};
+	first = n;
+	if(capture_output()) for(i = 0; i < nslots; i++, n++) {
+		job_info *job = sblist_get(prog_state.job_infos, i);
+		pfd[n].fd = output_stalled(job) ? -1 : job->out;
+		pfd[n].events = POLLIN;
+		pfd[n].revents = 0;
+	}
+	fflush(stdout);
+	if(ppoll(pfd, n, timeout_us < 0 ? NULL : &ts, NULL) <= 0) return 0;
+	if(pfd[0].revents)
+		while(read(sigchld_pipe[0], buf, sizeof buf) > 0);
+	if(trace.dump) trace_write();
+	for(i = first; i < n; i++)
+		if(pfd[i].revents) read_output(i - first);
+	return wfd != -1 && pfd[1].revents;
+}
+
+/* wait up to timeout ms (-1 for ever) for a child to exit, for wfd to
+   become writable, or for captured output, which is read. returns whether
+   wfd is writable. */
+static int wait_event(int timeout, int wfd) {
+	return wait_event_us(timeout < 0 ? -1 : timeout * 1000LL, wfd);
+}
+
+static void write_child(job_info *job, char *buf, size_t len) {
+	if(!capture_output()) {
+		write_all(job->pipe, buf, len);
+		return;
+	}
+	/* the child's pipe is non-blocking, so we can keep draining its
+	   output while it doesn't accept more input. */
+	while(len) {
+		ssize_t n = write(job->pipe, buf, len);
+		if(n == -1) {
+			if(errno == EAGAIN) wait_event(-1, job->pipe);
+			else if(errno != EINTR) {
+				perror("write");
+				return;
+			}
+			continue;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/* -coalesce: the lines for a worker are collected in its staging buffer,
+   and written with one syscall when it's full, or when the oldest staged
+   line waited -coalescedelay ms. the dispatcher's waits for input are cut
+   short for that. */
+static struct {
+	long long since; /* now_ms() when the oldest staged line was added, 0 if none */
+	unsigned long long writes;
+} coalesce;
+
+static void stage_flush(size_t i) {
+	job_info *job = sblist_get(prog_state.job_infos, i);
+	uint64_t t;
+	if(!job->staged) return;
+	t = trace_now();
+	write_child(job, job->stage, job->staged);
+	trace_end(TR_WRITE, t, i);
+	job->staged = 0;
+	coalesce.writes++;
+}
+
+static void stage_flush_all(void) {
+	size_t i;
+	if(!coalesce.since) return;
+	for(i = 0; i < sblist_getsize(prog_state.job_infos); i++)
+		stage_flush(i);
+	coalesce.since = 0;
+}
+
+static void stage_write(size_t i, char *line, size_t len) {
+	job_info *job = sblist_get(prog_state.job_infos, i);
+	if(job->staged + len > prog_state.coalesce) stage_flush(i);
+	if(len >= prog_state.coalesce) {
+		/* the staging buffer would only add a copy */
+		uint64_t t = trace_now();
+		write_child(job, line, len);
+		trace_end(TR_WRITE, t, i);
+		coalesce.writes++;
+		return;
+	}
+	if(!job->stage && !(job->stage = malloc(prog_state.coalesce)))
+		die("out of memory\n");
+	memcpy(job->stage + job->staged, line, len);
+	job->staged += len;
+	if(!coalesce.since) coalesce.since = now_ms();
+	else if(now_ms() - coalesce.since >= (long long) prog_state.coalesce_delay)
+		stage_flush_all();
+}
+
+/* flush the staged lines if fd has no input before they're due */
+static void stage_wait_input(int fd) {
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	long long ms;
+	if(!coalesce.since) return;
+	ms = coalesce.since + prog_state.coalesce_delay - now_ms();
+	if(ms <= 0 || poll(&pfd, 1, ms) == 0)
+		stage_flush_all();
+}
+
+/* token buckets for -rate and -bwlimit. the tokens refill at rate per
+   second, up to cap. taking more than cap is allowed once the bucket is
+   full, the debt is paid off before the next take. */
+typedef struct {
+	double rate, cap, tokens;
+	long long last; /* now_us() of the last refill */
+	/* for -stats: now_us() of the first and the last take, and the
+	   amount taken */
+	long long first, recent;
+	double taken;
+} token_bucket;
+
+static token_bucket launch_bucket, byte_bucket;
+
+static void bucket_init(token_bucket *b, double rate, double cap) {
+	*b = (token_bucket) {.rate = rate, .cap = cap, .tokens = cap, .last = now_us()};
+}
+
+/* take n tokens and return 0, or return the microseconds until they're there */
+static long long bucket_take(token_bucket *b, double n) {
+	long long now = now_us();
+	double need = n < b->cap ? n : b->cap;
+	b->tokens += (now - b->last) * b->rate / 1e6;
+	if(b->tokens > b->cap) b->tokens = b->cap;
+	b->last = now;
+	if(b->tokens < need)
+		return (long long) ((need - b->tokens) * 1e6 / b->rate) + 1;
+	if(!b->taken) b->first = now;
+	b->recent = now;
+	b->tokens -= n;
+	b->taken += n;
+	return 0;
+}
+
+/* wait for n tokens from b. children exiting and their output are
+   handled meanwhile, and lines passed on so far are written out. */
+static void bucket_wait(token_bucket *b, double n) {
+	long long us;
+	while((us = bucket_take(b, n))) {
+		if(uring.batch) uring_flush();
+		if(coalesce.since &&
+		   now_ms() + us / 1000 >= coalesce.since + (long long) prog_state.coalesce_delay)
+			stage_flush_all();
+		wait_event_us(us, -1);
+	}
+}
+
+static void rate_launch(void) {
+	bucket_wait(&launch_bucket, 1);
+}
+
+static void rate_bytes(size_t len) {
+	bucket_wait(&byte_bucket, len);
+}
+
+/* the rate achieved by b per second, from its first to its last take.
+   the initial burst went out at once, so it doesn't count. */
+static double bucket_rate(token_bucket *b) {
+	double secs = (b->recent - b->first) / 1e6;
+	if(b->taken > b->cap) return secs > 0 ? (b->taken - b->cap) / secs : 0;
+	return secs > 0 ? b->taken / secs : 0;
+}
+
+static int outputs_open(void) {
+	job_info *job;
+	if(capture_output()) sblist_iter(prog_state.job_infos, job)
+		if(job->out != -1) return 1;
+	return 0;
+}
+
+static void stream_failed(size_t stream);
+static void cache_store(size_t job_id);
+
+/* the slot of the job with pid, or -1 */
+static long slot_of(pid_t pid) {
+	size_t i;
+	for(i = 0; i < sblist_getsize(prog_state.job_infos); i++) {
+		job_info *job = sblist_get(prog_state.job_infos, i);
+		if(job->pid == pid) return i;
+	}
+	return -1;
+}
+
+/* -spawners: the slot of the job with pid once its spawner stored it,
+   or -1 if no spawn is pending that it could be from */
+static long spawned_slot(pid_t pid) {
+	long i;
+	pthread_mutex_lock(&spawners.mtx);
+	while((i = slot_of(pid)) == -1 && spawners.pending)
+		pthread_cond_wait(&spawners.done, &spawners.mtx);
+	pthread_mutex_unlock(&spawners.mtx);
+	return i;
+}
+
+/* -spawners: a slot whose vfork failed, or -1. with wait set, waits for
+   the pending spawns if there's none yet. */
+static long spawn_failed(bool wait) {
+	long i = -1;
+	size_t n;
+	pthread_mutex_lock(&spawners.mtx);
+	while(!(n = sblist_getsize(spawners.failed)) && wait && spawners.pending)
+		pthread_cond_wait(&spawners.done, &spawners.mtx);
+	if(n) {
+		i = *(size_t*) sblist_get(spawners.failed, n - 1);
+		sblist_delete(spawners.failed, n - 1);
+	}
+	pthread_mutex_unlock(&spawners.mtx);
+	return i;
+}
+
+/* -halt, -haltpercent: a job finished, stop launching new ones if too
+   many failed. failed lines are remembered, so that a statefile written
+   after the halt makes -resume run them again. */
+static void halt_rerun(unsigned long long lineno) {
+	if(!prog_state.halt_lineno || lineno < prog_state.halt_lineno)
+		prog_state.halt_lineno = lineno;
+}
+
+static void halt_check(job_info *job, bool failed) {
+	unsigned long long fin = ++prog_state.jobs_finished;
+	size_t i;
+	if(failed) halt_rerun(job->lineno);
+	if(prog_state.halted) return;
+	if(!(prog_state.halt && prog_state.jobs_failed >= prog_state.halt) &&
+	   !(prog_state.halt_percent > 0 && fin >= prog_state.halt_min &&
+	     prog_state.jobs_failed * 100.0 >= prog_state.halt_percent * fin))
+		return;
+	prog_state.halted = 1;
+	dprintf(2, "halt: %llu of %llu finished jobs failed, %s\n",
+		prog_state.jobs_failed, fin,
+		prog_state.halt_kill ? "terminating the running ones" : "waiting for the running ones");
+	if(!prog_state.halt_kill) return;
+	/* jobs still being spawned by -spawners have no pid yet, they run */
+	for(i = 0; i < sblist_getsize(prog_state.job_infos); i++) {
+		job_info *other = sblist_get(prog_state.job_infos, i);
+		if(other->pid > 0) kill(other->pid, SIGTERM);
+	}
+}
+
+/* wait till a child exits, reap it, and return its job index for slot reuse */
+static size_t reap_child(int *retval) {
+	long i;
+	job_info* job;
+	int ret;
+	uint64_t t = trace_now();
+
+	again:
+	if(prog_state.spawners && (i = spawn_failed(0)) != -1) {
+		*retval = 127 << 8;
+		goto found;
+	}
+	if(!need_event_loop()) {
+		ret = uring.fd != -1 && !uring.no_waitid ? uring_waitpid(retval) : 0;
+		if(!ret) do ret = waitpid(-1, retval, 0);
+		while(ret == -1 && errno == EINTR);
+	} else while(1) {
+		ret = waitpid(-1, retval, WNOHANG);
+		if(ret > 0 || (ret == -1 && errno != EINTR)) break;
+		if(ret == 0)
+			wait_event(prog_state.speculate ? speculate() : -1, -1);
+	}
+	if(ret == -1) {
+		/* with -spawners, the jobs left may not have been forked yet */
+		if(errno != ECHILD || !prog_state.spawners) abort();
+		if((i = spawn_failed(1)) == -1) goto again;
+		*retval = 127 << 8;
+		goto found;
+	}
+	i = prog_state.spawners ? spawned_slot(ret) : slot_of(ret);
+	/* not one of our jobs */
+	if(i == -1) goto again;
+
+	found:
+	assert(i != -1);
+	job = sblist_get(prog_state.job_infos, i);
+	PROBE4(job_reaped, i, job->lineno, *retval, now_ms() - job->started);
+	job->pid = -1;
+	fa_free(job);
+	prog_state.threads_running--;
+	trace_end(TR_WAIT, t, i);
+	trace_add(TR_JOB, TRACE_TID_SLOT + i, job->trace_start, job->lineno);
+	if(prog_state.line_output)
+		finish_output(i);
+	if(job->killed) {
+		job->killed = 0;
+		if(job->twin != -1) {
+			/* the winner unlinks both when it kills the loser, but don't
+			   leave a partner pointing at this slot once it's reused */
+			job_info *other = sblist_get(prog_state.job_infos, job->twin);
+			other->twin = -1;
+			job->twin = -1;
+		}
+		discard_output(i);
+		*retval = 0;
+		return i;
+	}
+	if(job->twin != -1) {
+		job_info *other = sblist_get(prog_state.job_infos, job->twin);
+		if(other->pid > 0) kill(other->pid, SIGTERM);
+		other->killed = 1;
+		other->twin = -1;
+		job->twin = -1;
+	}
+	if(process_failed(*retval)) {
+		prog_state.jobs_failed++;
+		if(prog_state.stream_specs) stream_failed(job->stream);
+	} else {
+		if(prog_state.cache) cache_store(i);
+		if(prog_state.speculate) record_runtime(job);
+	}
+	if(prog_state.halt || prog_state.halt_percent > 0)
+		halt_check(job, process_failed(*retval));
+	if(prog_state.buffered) {
+		dump_output(i, 0);
+		if(!prog_state.join_output)
+			dump_output(i, 1);
+	}
+	return i;
+}
+
+static unsigned long parse_human_number(const char* num) {
+	unsigned long ret = 0;
+	static const unsigned long mul[] = {1024, 1024 * 1024, 1024 * 1024 * 1024};
+	const char* kmg = "KMG";
+	const char* kmgind, *p;
+	ret = atol(num);
+	p = num;
+	while(isdigit(*(++p)));
+	if(*p && (kmgind = strchr(kmg, *p)))
+		ret *= mul[kmgind - kmg];
+	return ret;
+}
+
+static int syntax(void) {
+	dprintf(2,
+		"jobflow " VERSION " (C) rofl0r\n"
+		"------------------------\n"
+		"this program is intended to be used as a recipient of another programs output.\n"
+		"it launches processes to which the current line can be passed as an argument\n"
+		"using {} for substitution (as in find -exec).\n"
+		"if no input substitution argument ({} or {.}) is provided, input is piped into\n"
 		"stdin of child processes. input will be then evenly distributed to jobs,\n"
 		"until EOF is received. we call this 'pipe mode'.\n"
 		"\n"
 		"available options:\n\n"
 		"-skip N -count N -threads N -resume -statefile=/tmp/state -delayedflush\n"
 		"-delayedspinup N -buffered -joinoutput -limits mem=16M,cpu=10\n"
-		"-eof=XXX\n"
+		"-eof=XXX -speculate N -lookahead N -cost size -delim ,\n"
+		"-partition field:N -stats -merge -mergekey N -mergenumeric\n"
+		"-plugin ./handler.so -readahead 1M -spill /tmp/spill -spillmax 1G\n"
+		"-outfile out/{.}.txt -errfile out/{.}.err -linebuffered -tag\n"
+		"-trace /tmp/trace.json -tracesize N\n"
+		"-walk /data -name '*.x' -type f -walkthreads N\n"
+		"-stream name=a,path=a.list,weight=2,statefile=a.state,exec=./mycommand {}\n"
+		"-dag -cache /tmp/cache -cacheage N -cachemax N -cachestat\n"
+		"-dedup -dedupbloom N -dedupfp 0.001 -uring -spawners N\n"
+		"-0 -rs SEP -recsize N -coalesce 64K -coalescedelay MS\n"
+		"-rate N -burst N -bwlimit 1M\n"
+		"-halt N -haltpercent X -haltmin N -haltkill\n"
 		"-exec ./mycommand {}\n"
 		"\n"
 		"-skip N\n"
@@ -402,6 +2226,21 @@ static int syntax(void) {
 		"-delayedflush\n"
 		"    only write to statefile whenever all processes are busy,\n"
 		"    and at program end\n"
+		"-rate N\n"
+		"    start at most N jobs per second, N may be fractional.\n"
+		"-burst N\n"
+		"    with -rate, allow N jobs to start at once after an idle time (default 1).\n"
+		"-bwlimit N\n"
+		"    in pipe mode, pass at most N bytes per second to the jobs.\n"
+		"    the suffixes G/M/K are detected.\n"
+		"-halt N\n"
+		"    launch no more jobs once N jobs failed, and exit with 1.\n"
+		"-haltpercent X\n"
+		"    launch no more jobs once X percent of the finished jobs failed.\n"
+		"-haltmin N\n"
+		"    with -haltpercent, wait for N jobs to finish first (default 10).\n"
+		"-haltkill\n"
+		"    when halting, terminate the running jobs instead of waiting for them.\n"
 		"-delayedspinup N\n"
 		"    N=maximum amount of milliseconds\n"
 		"    ...to wait when spinning up a fresh set of processes\n"
@@ -415,6 +2254,7 @@ static int syntax(void) {
 		"    this prevents mixing up of output of different processes.\n"
 		"-joinoutput\n"
 		"    if -buffered, write both stdout and stderr into the same file.\n"
+		"    if -linebuffered, pass on stderr together with stdout.\n"
 		"    this saves the chronological order of the output, and the combined output\n"
 		"    will only be printed to stdout.\n"
 		"-bulk N\n"
@@ -428,27 +2268,205 @@ static int syntax(void) {
 		"    actual memory allocation will be twice the amount passed.\n"
 		"    note that pipe buffer size is limited to 64K on linux, so anything higher\n"
 		"    than that probably doesn't make sense.\n"
+		"-coalesce N\n"
+		"    in pipe mode, collect the lines for each job in a buffer of N bytes\n"
+		"    and write them at once. not usable with -bulk.\n"
+		"-coalescedelay MS\n"
+		"    write lines collected by -coalesce after MS milliseconds (default 2).\n"
+		"-0\n"
+		"    records end with a nul byte instead of a line break, as printed by\n"
+		"    find -print0.\n"
+		"-rs SEP\n"
+		"    records end with SEP, which may be several bytes long. \\n, \\t, \\r,\n"
+		"    \\0, \\\\ and \\xHH are decoded.\n"
+		"-recsize N\n"
+		"    records are N bytes long, without a separator.\n"
 		"-limits [mem=N,cpu=N,stack=N,fsize=N,nofiles=N]\n"
 		"    sets the rlimit of the new created processes.\n"
 		"    see \"man setrlimit\" for an explanation. the suffixes G/M/K are detected.\n"
+		"-speculate N\n"
+		"    when a slot is idle and a job runs longer than N times the median\n"
+		"    runtime of the finished jobs, start a second copy of it.\n"
+		"    whichever copy finishes first wins, the other one is killed.\n"
+		"    only use this with idempotent jobs. together with -buffered, only the\n"
+		"    output of the winning copy is printed. not usable in pipe mode.\n"
+		"-lookahead N\n"
+		"    keep a window of N pending lines, and launch the one with the highest\n"
+		"    cost (see -cost) first. {#} and -statefile still refer to the input\n"
+		"    line numbers, the statefile only advances past lines whose\n"
+		"    predecessors have all been launched. not usable in pipe mode.\n"
+		"-cost size|field:N\n"
+		"    how -lookahead estimates the cost of a line: size uses the size of the\n"
+		"    file named by the line, field:N the numeric value of the Nth field.\n"
+		"-delim C\n"
+		"    field separator for field:N and {N}. defaults to runs of blanks,\n"
+		"    \\t is a tab, blank runs of blanks. {N} in -exec needs it.\n"
+		"-partition field:N|bytes:N-M\n"
+		"    in pipe mode, send each line to the worker selected by the hash of\n"
+		"    its Nth field (see -delim) or of its bytes N to M, so the same key\n"
+		"    always ends up at the same worker. not usable with -bulk.\n"
+		"-stats\n"
+		"    print statistics to stderr at exit, in pipe mode including the\n"
+		"    amount of lines and bytes each worker received.\n"
+		"-merge\n"
+		"    in pipe mode, read the stdout of all workers and merge their sorted\n"
+		"    output into a single sorted stream, e.g. -bulk 64K -merge -exec sort.\n"
+		"    lines are compared bytewise, so the workers should sort with LC_ALL=C.\n"
+		"-mergekey N\n"
+		"    with -merge, compare lines by their Nth field (see -delim).\n"
+		"-mergenumeric\n"
+		"    with -merge, compare keys by their numeric value.\n"
+		"-plugin FILE\n"
+		"    load the shared object FILE and pass each line to its jobflow_process()\n"
+		"    function from -threads worker threads, instead of spawning a process.\n"
+		"    arguments after -exec are passed to jobflow_init().\n"
+		"    see jobflow_plugin.h for the interface.\n"
+		"-readahead N\n"
+		"    read the input from a separate thread into a buffer of N bytes, so\n"
+		"    stdin keeps being drained while all slots are busy.\n"
+		"    the suffixes G/M/K are detected.\n"
+		"-spill FILE\n"
+		"    with -readahead, store lines which don't fit into the buffer in FILE,\n"
+		"    so the program feeding us never has to wait.\n"
+		"-spillmax N\n"
+		"    limit the size of the data waiting in the spill file to N bytes.\n"
+		"-outfile TEMPLATE\n"
+		"    write the stdout of each job directly into the file named by TEMPLATE,\n"
+		"    which can contain the same placeholders as -exec, except in pipe mode.\n"
+		"    missing directories are created.\n"
+		"-errfile TEMPLATE\n"
+		"    like -outfile, for stderr. if both name the same file, it gets both.\n"
+		"-linebuffered\n"
+		"    pass on the stdout of jobs as it is produced, but only in whole lines,\n"
+		"    so lines of concurrent jobs never get mixed up. with -joinoutput,\n"
+		"    stderr is treated the same way.\n"
+		"-tag\n"
+		"    with -linebuffered, prefix each line with the job's line number\n"
+		"    and a tab.\n"
+		"-trace FILE\n"
+		"    record when jobflow reads input, substitutes, spawns, waits for\n"
+		"    jobs, writes to them, writes the statefile and dumps output, and\n"
+		"    when each slot runs a job. written to FILE as chrome trace json\n"
+		"    at exit, or on SIGUSR1.\n"
+		"-tracesize N\n"
+		"    number of most recent events kept for -trace (default 1M).\n"
+		"-walk DIR\n"
+		"    instead of reading stdin, process the paths of DIR and everything\n"
+		"    below it, like find DIR would list them, but in no particular order.\n"
+		"    can be given multiple times. symlinks below DIR are not followed.\n"
+		"    with -cost size, the size found while walking is used.\n"
+		"-name GLOB\n"
+		"    with -walk, only process entries whose name matches GLOB.\n"
+		"-type f|d|l|p|s|b|c\n"
+		"    with -walk, only process entries of the given type, as with find.\n"
+		"-walkthreads N\n"
+		"    number of threads walking the directories (default 4).\n"
+		"-stream name=X,path=FILE,weight=N,statefile=FILE,exec=CMD ARGS\n"
+		"    instead of reading stdin, run jobs for the lines of FILE, which can\n"
+		"    be a FIFO. can be given multiple times, the slots are shared by the\n"
+		"    streams in proportion to their weight (default 1), and streams which\n"
+		"    have no lines pending leave their share to the others.\n"
+		"    each stream has its own line numbers, statefile and -stats counters.\n"
+		"    exec= must come last, its arguments are separated by blanks.\n"
+		"    without it, the command after -exec is used.\n"
+		"    a failed job stops its stream, the others go on.\n"
+		"-dag\n"
+		"    every input line is a record ID DEPS PAYLOAD, where DEPS is a comma\n"
+		"    separated list of IDs, or - for none. the job for PAYLOAD ({} is the\n"
+		"    payload, {#} the record number) is started as soon as all jobs it\n"
+		"    depends on succeeded. if a job fails, the ones depending on it are\n"
+		"    skipped. the statefile is a log of the IDs of succeeded jobs, which\n"
+		"    are not run again with -resume.\n"
+		"-cache FILE\n"
+		"    remember the commands which succeeded in FILE, and don't run them\n"
+		"    again. with -buffered, their output is stored in FILE.data and\n"
+		"    printed instead.\n"
+		"-cacheage N\n"
+		"    forget cache entries which haven't been used for N seconds.\n"
+		"-cachemax N\n"
+		"    limit the size of the stored output to N bytes, by forgetting the\n"
+		"    least recently used entries. the suffixes G/M/K are detected.\n"
+		"-cachestat\n"
+		"    make the size and modification time of the file named by the line\n"
+		"    part of the cache key.\n"
+		"-dedup\n"
+		"    drop lines which were seen before. dropped lines still count for\n"
+		"    {#}, -skip and -statefile. not usable with -bulk.\n"
+		"-dedupbloom N\n"
+		"    like -dedup, but with a fixed amount of memory, sized for N\n"
+		"    distinct lines. a few lines seen for the first time are dropped too,\n"
+		"    see -dedupfp.\n"
+		"-dedupfp P\n"
+		"    the rate of lines wrongly dropped by -dedupbloom (default 0.001).\n"
+		"-uring\n"
+		"    use io_uring for reading stdin if it's a file, for writing to the\n"
+		"    workers in pipe mode, for printing -buffered output and for waiting\n"
+		"    for jobs. falls back to the usual syscalls if it's not available.\n"
+		"-spawners N\n"
+		"    start the jobs from N threads, while the main thread goes on reading\n"
+		"    input. a job whose command can't be executed exits with 127.\n"
+		"    not usable with -speculate.\n"
 		"-exec command with args\n"
 		"    everything past -exec is treated as the command to execute on each line of\n"
 		"    stdin received. the line can be passed as an argument using {}.\n"
 		"    {.} passes everything before the last dot in a line as an argument.\n"
 		"    {#} will be replaced with the sequence (aka line) number.\n"
+		"    with -delim, {N} passes the Nth field of the line, {-N} the Nth\n"
+		"    field from the end, {N..M} the fields N to M. ${N} is left alone.\n"
 		"    usage of {#} does not affect the decision whether pipe mode is used.\n"
-		"    it is possible to use multiple substitutions inside a single argument,\n"
-		"    but only of one type.\n"
+		"    it is possible to use multiple substitutions inside a single argument.\n"
 		"    if -exec is omitted, input will merely be dumped to stdout (like cat).\n"
 		"\n"
 	);
 	return 1;
 }
 
+/* the number of lines to skip to resume from statefile fn */
+static unsigned long read_statefile(const char *fn) {
+	unsigned long ret = 0;
+	if(access(fn, W_OK | R_OK) != -1) {
+		FILE *f = fopen(fn, "r");
+		if(f) {
+			char nb[64];
+			if(fgets(nb, sizeof nb, f)) ret = strtoll(nb,0,10);
+			fclose(f);
+		}
+	}
+	return ret;
+}
+
+/* decode the \n, \t, \r, \0, \\ and \xHH escapes of s into buf. returns
+   the length, or -1 if it doesn't fit or an escape is invalid. */
+static int unescape(const char *s, char *buf, size_t size) {
+	size_t n = 0;
+	for(; *s; s++) {
+		int c = *s;
+		if(c == '\\') switch(*(++s)) {
+			case 'n': c = '\n'; break;
+			case 't': c = '\t'; break;
+			case 'r': c = '\r'; break;
+			case '0': c = 0; break;
+			case '\\': c = '\\'; break;
+			case 'x':
+				if(!isxdigit(s[1]) || !isxdigit(s[2])) return -1;
+				char hex[3] = {s[1], s[2], 0};
+				c = strtol(hex, 0, 16);
+				s += 2;
+				break;
+			default: return -1;
+		}
+		if(n == size) return -1;
+		buf[n++] = c;
+	}
+	return n;
+}
+
+static void parse_streams(bool resume);
+
 static int parse_args(unsigned argc, char** argv) {
 	unsigned i, j, r = 0;
-	static bool resume = 0;
-	static char *limits = 0;
+	static bool resume = 0, nul = 0;
+	static char *limits = 0, *cost = 0, *delim = 0, *partition = 0, *type = 0, *dedupfp = 0, *rs = 0, *rate = 0, *haltpercent = 0;
 	static const struct {
 		const char lname[14];
 		const char sname;
@@ -457,6 +2475,7 @@ static int parse_args(unsigned argc, char** argv) {
 			bool *b;
 			unsigned long *i;
 			char **s;
+			sblist **l;
 		} dest;
 	} opt_tab[] = {
 		{"threads", 'j', 'i', .dest.i = &prog_state.numthreads },
@@ -471,10 +2490,62 @@ static int parse_args(unsigned argc, char** argv) {
 		{"joinoutput", 0, 'b', .dest.b =&prog_state.join_output},
 		{"bulk", 0, 'i', .dest.i = &prog_state.bulk_bytes},
 		{"limits", 0, 's', .dest.s = &limits},
+		{"speculate", 0, 'i', .dest.i = &prog_state.speculate},
+		{"lookahead", 0, 'i', .dest.i = &prog_state.lookahead},
+		{"cost", 0, 's', .dest.s = &cost},
+		{"delim", 0, 's', .dest.s = &delim},
+		{"partition", 0, 's', .dest.s = &partition},
+		{"stats", 0, 'b', .dest.b = &prog_state.stats},
+		{"merge", 0, 'b', .dest.b = &prog_state.merge},
+		{"mergekey", 0, 'i', .dest.i = &prog_state.merge_key},
+		{"mergenumeric", 0, 'b', .dest.b = &prog_state.merge_numeric},
+		{"plugin", 0, 's', .dest.s = &prog_state.plugin},
+		{"readahead", 0, 'i', .dest.i = &prog_state.readahead},
+		{"spill", 0, 's', .dest.s = &prog_state.spill},
+		{"spillmax", 0, 'i', .dest.i = &prog_state.spill_max},
+		{"outfile", 0, 's', .dest.s = &prog_state.out_template},
+		{"errfile", 0, 's', .dest.s = &prog_state.err_template},
+		{"linebuffered", 0, 'b', .dest.b = &prog_state.line_output},
+		{"tag", 0, 'b', .dest.b = &prog_state.tag},
+		{"trace", 0, 's', .dest.s = &prog_state.trace},
+		{"tracesize", 0, 'i', .dest.i = &prog_state.trace_size},
+		{"walk", 0, 'l', .dest.l = &prog_state.walk},
+		{"name", 0, 's', .dest.s = &prog_state.walk_name},
+		{"type", 0, 's', .dest.s = &type},
+		{"walkthreads", 0, 'i', .dest.i = &prog_state.walk_threads},
+		{"spawners", 0, 'i', .dest.i = &prog_state.spawners},
+		{"stream", 0, 'l', .dest.l = &prog_state.stream_specs},
+		{"dag", 0, 'b', .dest.b = &prog_state.dag},
+		{"cache", 0, 's', .dest.s = &prog_state.cache},
+		{"cacheage", 0, 'i', .dest.i = &prog_state.cache_age},
+		{"cachemax", 0, 'i', .dest.i = &prog_state.cache_max},
+		{"cachestat", 0, 'b', .dest.b = &prog_state.cache_stat},
+		{"dedup", 0, 'b', .dest.b = &prog_state.dedup},
+		{"dedupbloom", 0, 'i', .dest.i = &prog_state.dedup_bloom},
+		{"dedupfp", 0, 's', .dest.s = &dedupfp},
+		{"uring", 0, 'b', .dest.b = &prog_state.uring},
+		{"null", '0', 'b', .dest.b = &nul},
+		{"rs", 0, 's', .dest.s = &rs},
+		{"recsize", 0, 'i', .dest.i = &prog_state.recsize},
+		{"coalesce", 0, 'i', .dest.i = &prog_state.coalesce},
+		{"coalescedelay", 0, 'i', .dest.i = &prog_state.coalesce_delay},
+		{"rate", 0, 's', .dest.s = &rate},
+		{"burst", 0, 'i', .dest.i = &prog_state.burst},
+		{"bwlimit", 0, 'i', .dest.i = &prog_state.bwlimit},
+		{"halt", 0, 'i', .dest.i = &prog_state.halt},
+		{"haltpercent", 0, 's', .dest.s = &haltpercent},
+		{"haltmin", 0, 'i', .dest.i = &prog_state.halt_min},
+		{"haltkill", 0, 'b', .dest.b = &prog_state.halt_kill},
 	};
 
 	prog_state.numthreads = 1;
 	prog_state.count = -1UL;
+	prog_state.trace_size = 1024*1024;
+	prog_state.walk_threads = 4;
+	prog_state.rs[0] = '\n';
+	prog_state.coalesce_delay = (unsigned long) -1;
+	prog_state.halt_min = (unsigned long) -1;
+	prog_state.rs_len = 1;
 
 	for(i=1; i<argc; ++i) {
 		char *p = argv[i], *q = strchr(p, '=');
@@ -487,7 +2558,7 @@ static int parse_args(unsigned argc, char** argv) {
 			   (q && strlen(opt_tab[j].lname) == q-p && !strncmp(p, opt_tab[j].lname, q-p))) {
 				switch(opt_tab[j].flag) {
 				case 'b': *opt_tab[j].dest.b=1; break;
-				case 'i': case 's':
+				case 'i': case 's': case 'l':
 					if(!q) {
 						if(argc <= i+1 || argv[i+1][0] == '-') {
 						e_expect_op:;
@@ -501,6 +2572,10 @@ static int parse_args(unsigned argc, char** argv) {
 						if(!isdigit(*q))
 							die("expected numeric operand for %s at %s\n", p, q);
 						*opt_tab[j].dest.i=parse_human_number(q);
+					} else if(opt_tab[j].flag == 'l') {
+						if(!*opt_tab[j].dest.l)
+							*opt_tab[j].dest.l = sblist_new(sizeof(char*), 4);
+						sblist_add(*opt_tab[j].dest.l, &q);
 					} else
 						*opt_tab[j].dest.s=q;
 					break;
@@ -520,21 +2595,24 @@ static int parse_args(unsigned argc, char** argv) {
 
 	if((long)prog_state.numthreads <= 0) die("threadcount must be >= 1\n");
 
-	if(resume) {
+	if(resume && !prog_state.stream_specs && !prog_state.dag) {
 		if(!prog_state.statefile) die("-resume needs -statefile\n");
-		if(access(prog_state.statefile, W_OK | R_OK) != -1) {
-			FILE *f = fopen(prog_state.statefile, "r");
-			if(f) {
-				char nb[64];
-				if(fgets(nb, sizeof nb, f)) prog_state.skip = strtoll(nb,0,10);
-				fclose(f);
-			}
-		}
+		prog_state.skip = read_statefile(prog_state.statefile);
 	}
 
 	if(prog_state.delayedflush && !prog_state.statefile)
 		die("-delayedflush needs -statefile\n");
 
+	/* only with -delim, so commands with braces of their own, like
+	   grep -E 'x{2}', work as before */
+	if(delim) {
+		prog_state.fields = 1;
+		if(!strcmp(delim, "\\t")) prog_state.delim = '\t';
+		else if(!strcmp(delim, "blank")) prog_state.delim = 0;
+		else if(strlen(delim) == 1) prog_state.delim = *delim;
+		else die("-delim expects a single character or blank\n");
+	}
+
 	prog_state.pipe_mode = 1;
 	prog_state.cmd_startarg = r;
 	prog_state.subst_entries = NULL;
@@ -550,14 +2628,13 @@ static int parse_args(unsigned argc, char** argv) {
 		// save entries which must be substituted, to save some cycles.
 		for(i = r; i < (unsigned) argc; i++) {
 			subst_ent = i - r;
-			char *a, *b, *c=0;
-			if((a = strstr(argv[i], "{}")) ||
-			   (b = strstr(argv[i], "{.}")) ||
-			   (c = strstr(argv[i], "{#}"))) {
-				if(!c) prog_state.pipe_mode = 0;
-				else prog_state.use_seqnr = 1;
+			int line_ref = jobflow_line_ref(argv[i],
+				prog_state.fields ? prog_state.delim : JOBFLOW_NO_FIELDS);
+			int seq_ref = !!strstr(argv[i], "{#}");
+			if(line_ref) prog_state.pipe_mode = 0;
+			if(seq_ref) prog_state.use_seqnr = 1;
+			if(line_ref || seq_ref)
 				sblist_add(prog_state.subst_entries, &subst_ent);
-			}
 		}
 		if(sblist_getsize(prog_state.subst_entries) == 0) {
 			sblist_free(prog_state.subst_entries);
@@ -565,15 +2642,233 @@ static int parse_args(unsigned argc, char** argv) {
 		}
 	}
 
-	if(prog_state.join_output && !prog_state.buffered)
-		die("-joinoutput needs -buffered\n");
+	if(prog_state.out_template || prog_state.err_template) {
+		if(prog_state.buffered || prog_state.merge || prog_state.speculate || prog_state.plugin)
+			die("-outfile/-errfile are not compatible with -buffered, -merge, -speculate and -plugin\n");
+		if(!prog_state.cmd_startarg)
+			die("-outfile/-errfile need -exec\n");
+		int fdelim = prog_state.fields ? prog_state.delim : JOBFLOW_NO_FIELDS;
+		int seq_ref = (prog_state.out_template && strstr(prog_state.out_template, "{#}")) ||
+		              (prog_state.err_template && strstr(prog_state.err_template, "{#}"));
+		/* a pipe mode worker gets many lines, but opens its files once */
+		if(prog_state.pipe_mode && (seq_ref ||
+		   (prog_state.out_template && jobflow_line_ref(prog_state.out_template, fdelim)) ||
+		   (prog_state.err_template && jobflow_line_ref(prog_state.err_template, fdelim))))
+			die("-outfile/-errfile placeholders need a line placeholder in -exec\n");
+		if(seq_ref) prog_state.use_seqnr = 1;
+	}
 
-	if(prog_state.bulk_bytes % 4096)
-		die("bulk size must be a multiple of 4096\n");
+	if(prog_state.line_output) {
+		if(prog_state.buffered || prog_state.merge || prog_state.out_template || prog_state.plugin)
+			die("-linebuffered is not compatible with -buffered, -merge, -outfile and -plugin\n");
+		if(!prog_state.cmd_startarg)
+			die("-linebuffered needs -exec\n");
+	} else if(prog_state.tag)
+		die("-tag needs -linebuffered\n");
 
-	if(limits) {
-		unsigned i;
-		while(1) {
+	if(prog_state.join_output && !prog_state.buffered && !prog_state.line_output)
+		die("-joinoutput needs -buffered or -linebuffered\n");
+
+	if(prog_state.speculate && prog_state.pipe_mode)
+		die("-speculate is not compatible with pipe mode\n");
+
+	/* a speculative twin can't be killed before its spawner started it */
+	if(prog_state.speculate && prog_state.spawners)
+		die("-speculate is not compatible with -spawners\n");
+	/* the loser's lines would already have been passed on */
+	if(prog_state.speculate && prog_state.line_output)
+		die("-speculate is not compatible with -linebuffered\n");
+
+	if(nul + !!rs + !!prog_state.recsize > 1)
+		die("-0, -rs and -recsize are exclusive\n");
+	if(nul) prog_state.rs[0] = 0;
+	if(rs) {
+		int n = unescape(rs, prog_state.rs, sizeof prog_state.rs);
+		if(n < 1) die("-rs expects 1 to %zu bytes, with \\n, \\t, \\r, \\0, \\\\ or \\xHH escapes\n", sizeof prog_state.rs);
+		prog_state.rs_len = n;
+	}
+	if(prog_state.recsize) {
+		prog_state.rs_len = 0;
+		if(prog_state.walk || prog_state.dag || prog_state.stream_specs)
+			die("-recsize is not compatible with -walk, -dag and -stream\n");
+	}
+
+	if(cost) {
+		if(!strcmp(cost, "size")) prog_state.cost_mode = COST_SIZE;
+		else if(!strncmp(cost, "field:", 6) && isdigit(cost[6])) {
+			prog_state.cost_mode = COST_FIELD;
+			prog_state.cost_field = atol(cost + 6);
+		}
+		if(prog_state.cost_mode == COST_NONE || (prog_state.cost_mode == COST_FIELD && !prog_state.cost_field))
+			die("-cost expects size or field:N\n");
+		if(!prog_state.lookahead)
+			die("-cost needs -lookahead\n");
+	}
+
+	if(partition) {
+		if(!strncmp(partition, "field:", 6) && isdigit(partition[6]))
+			prog_state.part_field = atol(partition + 6);
+		else if(!strncmp(partition, "bytes:", 6) && isdigit(partition[6])) {
+			char *e;
+			prog_state.part_start = strtoul(partition + 6, &e, 10);
+			if(*e == '-' && isdigit(e[1])) prog_state.part_end = strtoul(e + 1, 0, 10);
+			else if(!*e) prog_state.part_end = prog_state.part_start;
+		}
+		if(!prog_state.part_field && (!prog_state.part_start || prog_state.part_end < prog_state.part_start))
+			die("-partition expects field:N or bytes:N-M\n");
+		if(!prog_state.pipe_mode || prog_state.bulk_bytes)
+			die("-partition needs pipe mode without -bulk\n");
+	}
+
+	if(prog_state.plugin) {
+		if(prog_state.speculate || prog_state.merge || partition || limits ||
+		   prog_state.join_output || prog_state.bulk_bytes || prog_state.buffered)
+			die("-plugin is not compatible with -speculate, -merge, -partition, -limits, -joinoutput, -bulk and -buffered\n");
+		/* the arguments are passed to jobflow_init() once, not per line */
+		if(prog_state.subst_entries)
+			die("-plugin arguments can't contain placeholders\n");
+		/* every line is a record handed to the plugin, which decides
+		   nothing about pipe mode. the options needing it are refused
+		   below. */
+		prog_state.pipe_mode = 0;
+	}
+
+	if(prog_state.merge) {
+		if(!prog_state.pipe_mode || !prog_state.cmd_startarg)
+			die("-merge needs pipe mode\n");
+		if(prog_state.buffered)
+			die("-merge is not compatible with -buffered\n");
+	} else if(prog_state.merge_key || prog_state.merge_numeric)
+		die("-mergekey and -mergenumeric need -merge\n");
+
+	if(prog_state.lookahead) {
+		if(prog_state.pipe_mode)
+			die("-lookahead is not compatible with pipe mode\n");
+		prog_state.window = sblist_new(sizeof(pending_line), prog_state.lookahead);
+	}
+
+	if(prog_state.readahead) {
+		/* a ring must have room for at least two full input chunks */
+		size_t chunksize = input_chunksize();
+		if(prog_state.readahead < 4 * (chunksize + 16))
+			die("-readahead must be at least 4 times the chunk size (%zu)\n", 4 * (chunksize + 16));
+	} else if(prog_state.spill || prog_state.spill_max)
+		die("-spill and -spillmax need -readahead\n");
+	if(prog_state.spill_max && !prog_state.spill)
+		die("-spillmax needs -spill\n");
+
+	if(prog_state.bulk_bytes % 4096)
+		die("bulk size must be a multiple of 4096\n");
+
+	if(prog_state.trace && !prog_state.trace_size)
+		die("-tracesize must be >= 1\n");
+
+	if(prog_state.stream_specs) {
+		if(prog_state.statefile || prog_state.skip || prog_state.count != -1UL ||
+		   prog_state.eof_marker || prog_state.walk || prog_state.readahead ||
+		   prog_state.plugin || prog_state.lookahead || prog_state.bulk_bytes ||
+		   prog_state.merge || partition || prog_state.out_template || prog_state.err_template)
+			die("-stream is not compatible with -statefile, -skip, -count, -eof, -walk, -readahead, "
+			    "-plugin, -lookahead, -bulk, -merge, -partition, -outfile and -errfile\n");
+		/* every line of a stream is passed to a job of its own */
+		prog_state.pipe_mode = 0;
+		parse_streams(resume);
+	}
+
+	if(prog_state.coalesce) {
+		if(!prog_state.pipe_mode || prog_state.bulk_bytes)
+			die("-coalesce needs pipe mode without -bulk\n");
+		if(prog_state.coalesce_delay == (unsigned long) -1)
+			prog_state.coalesce_delay = 2;
+	} else if(prog_state.coalesce_delay != (unsigned long) -1)
+		die("-coalescedelay needs -coalesce\n");
+
+	if(rate) {
+		prog_state.rate = strtod(rate, 0);
+		if(!(prog_state.rate > 0))
+			die("-rate expects a number of launches per second\n");
+		if(prog_state.plugin)
+			die("-rate is not compatible with -plugin\n");
+		if(!prog_state.burst) prog_state.burst = 1;
+		bucket_init(&launch_bucket, prog_state.rate, prog_state.burst);
+	} else if(prog_state.burst)
+		die("-burst needs -rate\n");
+	if(prog_state.bwlimit) {
+		if(!prog_state.pipe_mode)
+			die("-bwlimit needs pipe mode\n");
+		/* a tenth of a second's worth, and at least a page */
+		bucket_init(&byte_bucket, prog_state.bwlimit,
+		            prog_state.bwlimit / 10 > 4096 ? prog_state.bwlimit / 10 : 4096);
+	}
+
+	if(haltpercent) {
+		prog_state.halt_percent = strtod(haltpercent, 0);
+		if(!(prog_state.halt_percent > 0 && prog_state.halt_percent <= 100))
+			die("-haltpercent expects a percentage between 0 and 100\n");
+		if(prog_state.halt_min == (unsigned long) -1)
+			prog_state.halt_min = 10;
+	} else if(prog_state.halt_min != (unsigned long) -1)
+		die("-haltmin needs -haltpercent\n");
+	if(prog_state.halt || haltpercent) {
+		/* pipe mode workers are only reaped at the end of the input */
+		if(prog_state.pipe_mode || prog_state.plugin || prog_state.dag || prog_state.stream_specs)
+			die("-halt is not compatible with pipe mode, -plugin, -dag and -stream\n");
+	} else if(prog_state.halt_kill)
+		die("-haltkill needs -halt or -haltpercent\n");
+
+	if(prog_state.dedup_bloom) prog_state.dedup = 1;
+	if(prog_state.dedup) {
+		if(prog_state.bulk_bytes || prog_state.dag || prog_state.stream_specs)
+			die("-dedup is not compatible with -bulk, -dag and -stream\n");
+		prog_state.dedup_fp = dedupfp ? strtod(dedupfp, 0) : 0.001;
+		if(!(prog_state.dedup_fp > 0 && prog_state.dedup_fp < 1))
+			die("-dedupfp expects a rate between 0 and 1\n");
+		if(dedupfp && !prog_state.dedup_bloom)
+			die("-dedupfp needs -dedupbloom\n");
+	}
+
+	if(prog_state.cache) {
+		if(!prog_state.cmd_startarg || prog_state.pipe_mode)
+			die("-cache needs -exec with {}\n");
+		if(prog_state.plugin || prog_state.dag || prog_state.stream_specs)
+			die("-cache is not compatible with -plugin, -dag and -stream\n");
+	} else if(prog_state.cache_age || prog_state.cache_max || prog_state.cache_stat)
+		die("-cacheage, -cachemax and -cachestat need -cache\n");
+
+	if(prog_state.dag) {
+		if(!prog_state.cmd_startarg || prog_state.pipe_mode)
+			die("-dag needs -exec with {}\n");
+		if(prog_state.skip || prog_state.count != -1UL || prog_state.eof_marker ||
+		   prog_state.delayedflush || prog_state.speculate || prog_state.lookahead ||
+		   prog_state.walk || prog_state.stream_specs || prog_state.readahead ||
+		   prog_state.plugin || prog_state.out_template || prog_state.err_template)
+			die("-dag is not compatible with -skip, -count, -eof, -delayedflush, -speculate, "
+			    "-lookahead, -walk, -stream, -readahead, -plugin, -outfile and -errfile\n");
+		if(resume && !prog_state.statefile)
+			die("-resume needs -statefile\n");
+		prog_state.dag_resume = resume;
+	}
+
+	if(prog_state.walk) {
+		/* the order in which entries are found differs between runs */
+		if(resume || prog_state.readahead || prog_state.eof_marker)
+			die("-walk is not compatible with -resume, -readahead and -eof\n");
+		if(!prog_state.walk_threads)
+			die("-walkthreads must be >= 1\n");
+		if(type) {
+			static const char types[] = "fdlpsbc";
+			static const int dt[] = {DT_REG, DT_DIR, DT_LNK, DT_FIFO, DT_SOCK, DT_BLK, DT_CHR};
+			const char *t = strchr(types, *type);
+			if(!*type || type[1] || !t)
+				die("-type expects one of %s\n", types);
+			prog_state.walk_type = dt[t - types];
+		}
+	} else if(prog_state.walk_name || type)
+		die("-name and -type need -walk\n");
+
+	if(limits) {
+		unsigned i;
+		while(1) {
 			limits += strspn(limits, ",");
 			size_t l = strcspn(limits, ",");
 			if(!l) break;
@@ -610,117 +2905,680 @@ static int parse_args(unsigned argc, char** argv) {
 
 static void init_queue(void) {
 	unsigned i;
-	job_info ji = {.pid = -1};
+	job_info ji = {.pid = -1, .twin = -1, .pipe = -1, .out = -1, .spawn_close = {-1, -1}};
 
 	for(i = 0; i < prog_state.numthreads; i++)
 		sblist_add(prog_state.job_infos, &ji);
 }
 
-static void write_statefile(unsigned long long n, const char* tempfile) {
-	int fd = open(tempfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	if(fd != -1) {
-		dprintf(fd, "%llu\n", n + 1ULL);
-		close(fd);
-		if(rename(tempfile, prog_state.statefile) == -1)
-			perror("rename");
-	} else
-		perror("open");
+static void write_statefile(unsigned long long n, const char* tempfile, const char* statefile) {
+	uint64_t t = trace_now();
+	if(jobflow_write_statefile(tempfile, statefile, n + 1ULL))
+		perror("statefile");
+	else
+		PROBE1(statefile_written, n + 1ULL);
+	trace_end(TR_STATEFILE, t, n);
 }
 
-static int str_here(char* haystack, size_t hay_size, size_t bufpos,
-		    char* needle, size_t needle_size) {
-	if(needle_size <= hay_size - bufpos) {
-		if(!memcmp(needle, haystack + bufpos, needle_size))
-			return 1;
+static int need_linecounter(void) {
+	return !!prog_state.skip || prog_state.statefile ||
+	       prog_state.use_seqnr || prog_state.count != -1UL;
+}
+static int match_eof(char* inbuf, size_t len) {
+	if(!prog_state.eof_marker) return 0;
+	size_t l = strlen(prog_state.eof_marker);
+	return len >= prog_state.rs_len && l == len - prog_state.rs_len &&
+	       !memcmp(prog_state.eof_marker, inbuf, l);
+}
+
+/* in-process plugin execution, see jobflow_plugin.h.
+   the dispatcher puts records into a bounded queue, from which -threads
+   worker threads take them and call the plugin. */
+static struct {
+	void *handle;
+	int (*init)(void **, int, char **);
+	ssize_t (*process)(void *, const char *, size_t, unsigned long long, char *, size_t);
+	void (*fini)(void *);
+	int argc;
+	char **argv;
+	pthread_t *threads;
+	pthread_mutex_t mtx, out_mtx;
+	pthread_cond_t not_empty, not_full;
+	pending_line *queue;
+	size_t qsize, qhead, qcount, idle;
+	bool closing;
+	unsigned long long failed;
+} plugin = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+	.out_mtx = PTHREAD_MUTEX_INITIALIZER,
+	.not_empty = PTHREAD_COND_INITIALIZER,
+	.not_full = PTHREAD_COND_INITIALIZER,
+};
+
+static void plugin_flush(char *out, size_t *len) {
+	if(!*len) return;
+	pthread_mutex_lock(&plugin.out_mtx);
+	write_all(1, out, *len);
+	pthread_mutex_unlock(&plugin.out_mtx);
+	*len = 0;
+}
+
+/* the output of the records is collected in a per-thread buffer, which is
+   written out when it's full or when the thread runs out of work. */
+#define PLUGIN_OUTBUF (64*1024)
+static void* plugin_worker(void *arg) {
+	void *ctx = 0;
+	size_t outsize = PLUGIN_OUTBUF, outlen = 0;
+	char *out = malloc(outsize);
+	pending_line rec;
+	(void) arg;
+
+	if(!out || plugin.init(&ctx, plugin.argc, plugin.argv)) {
+		/* without a context, this worker can't take records. the failure
+		   makes plugin_submit() stop the input, also if it waits for
+		   room in the queue, which the other workers may never make. */
+		dprintf(2, "error: plugin initialization failed\n");
+		pthread_mutex_lock(&plugin.mtx);
+		plugin.failed++;
+		pthread_cond_broadcast(&plugin.not_full);
+		pthread_mutex_unlock(&plugin.mtx);
+		free(out);
+		return 0;
+	}
+	while(1) {
+		pthread_mutex_lock(&plugin.mtx);
+		if(!plugin.qcount && outlen) {
+			pthread_mutex_unlock(&plugin.mtx);
+			plugin_flush(out, &outlen);
+			continue;
+		}
+		while(!plugin.qcount && !plugin.closing) {
+			plugin.idle++;
+			pthread_cond_wait(&plugin.not_empty, &plugin.mtx);
+			plugin.idle--;
+		}
+		if(!plugin.qcount) {
+			pthread_mutex_unlock(&plugin.mtx);
+			break;
+		}
+		rec = plugin.queue[plugin.qhead];
+		plugin.qhead = (plugin.qhead + 1) % plugin.qsize;
+		if(plugin.qcount-- == plugin.qsize)
+			pthread_cond_signal(&plugin.not_full);
+		pthread_mutex_unlock(&plugin.mtx);
+
+		ssize_t n = -1;
+		while(out) {
+			n = plugin.process(ctx, rec.line, rec.len, rec.lineno, out + outlen, outsize - outlen);
+			if(n < 0 || (size_t) n <= outsize - outlen) break;
+			if(outlen) {
+				plugin_flush(out, &outlen);
+				continue;
+			}
+			char *p = realloc(out, n);
+			if(!p) {
+				n = -1;
+				break;
+			}
+			out = p;
+			outsize = n;
+		}
+		free(rec.line);
+		if(n >= 0) outlen += n;
+		else {
+			pthread_mutex_lock(&plugin.mtx);
+			plugin.failed++;
+			pthread_mutex_unlock(&plugin.mtx);
+		}
 	}
+	if(out) plugin_flush(out, &outlen);
+	if(plugin.fini) plugin.fini(ctx);
+	free(out);
 	return 0;
 }
-// returns numbers of substitutions done, -1 on out of buffer.
-// dest is always overwritten. if no substitutions were done, it contains a copy of source.
-static int substitute_all(char *dest, ssize_t dest_size,
-		   char *src, size_t src_size,
-		   char *what, size_t what_size,
-		   char *whit, size_t whit_size) {
+
+static void plugin_load(int argc, char** argv) {
 	size_t i;
-	int ret = 0;
-	for(i = 0; dest_size > 0 && i < src_size; ) {
-		if(str_here(src, src_size, i, what, what_size)) {
-			if(dest_size < (ssize_t) whit_size) return -1;
-			memcpy(dest, whit, whit_size);
-			dest += whit_size;
-			dest_size -= whit_size;
-			ret++;
-			i += what_size;
-		} else {
-			*dest = src[i];
-			dest++;
-			dest_size--;
-			i++;
+	if(!(plugin.handle = dlopen(prog_state.plugin, RTLD_NOW | RTLD_LOCAL)))
+		die("%s\n", dlerror());
+	*(void **) &plugin.init = dlsym(plugin.handle, "jobflow_init");
+	*(void **) &plugin.process = dlsym(plugin.handle, "jobflow_process");
+	*(void **) &plugin.fini = dlsym(plugin.handle, "jobflow_fini");
+	if(!plugin.init || !plugin.process)
+		die("plugin lacks jobflow_init or jobflow_process\n");
+	if(prog_state.cmd_startarg) {
+		plugin.argc = argc - prog_state.cmd_startarg;
+		plugin.argv = argv + prog_state.cmd_startarg;
+	}
+	plugin.qsize = prog_state.numthreads * 4 < 1024 ? 1024 : prog_state.numthreads * 4;
+	plugin.queue = calloc(plugin.qsize, sizeof(pending_line));
+	plugin.threads = calloc(prog_state.numthreads, sizeof(pthread_t));
+	if(!plugin.queue || !plugin.threads) die("out of memory\n");
+	for(i = 0; i < prog_state.numthreads; i++)
+		if((errno = pthread_create(&plugin.threads[i], 0, plugin_worker, 0))) {
+			perror("pthread_create");
+			die("could not start plugin threads\n");
 		}
+}
+
+/* hand a record to the workers. returns 0 if a record failed so far,
+   which stops dispatching, like a failed job does in exec mode. */
+static int plugin_submit(char* line, size_t len, unsigned long long lineno) {
+	pending_line rec = {.lineno = lineno, .len = len};
+	int ret;
+	if(!(rec.line = malloc(len + 1))) die("out of memory\n");
+	memcpy(rec.line, line, len);
+	rec.line[len] = 0;
+	pthread_mutex_lock(&plugin.mtx);
+	while(plugin.qcount == plugin.qsize && !plugin.failed)
+		pthread_cond_wait(&plugin.not_full, &plugin.mtx);
+	if(plugin.failed) {
+		pthread_mutex_unlock(&plugin.mtx);
+		free(rec.line);
+		return 0;
 	}
-	if(!dest_size) return -1;
-	*dest = 0;
+	plugin.queue[(plugin.qhead + plugin.qcount) % plugin.qsize] = rec;
+	/* one woken up worker is enough to keep up with a few queued records,
+	   more of them are woken up only once a backlog builds up. */
+	plugin.qcount++;
+	if(plugin.idle && (plugin.qcount == 1 || plugin.qcount > plugin.qsize / 2))
+		pthread_cond_signal(&plugin.not_empty);
+	ret = !plugin.failed;
+	pthread_mutex_unlock(&plugin.mtx);
+	prog_state.jobs_started++;
 	return ret;
 }
 
-static char* mystrnchr(const char *in, int ch, size_t end) {
-	const char *e = in+end;
-	const char *p = in;
-	while(p != e && *p != ch) p++;
-	if(p != e) return (char*)p;
+/* wait for the queue to drain and the workers to finish.
+   returns the number of failed records. */
+static unsigned long long plugin_finish(void) {
+	size_t i;
+	pthread_mutex_lock(&plugin.mtx);
+	plugin.closing = 1;
+	pthread_cond_broadcast(&plugin.not_empty);
+	pthread_mutex_unlock(&plugin.mtx);
+	for(i = 0; i < prog_state.numthreads; i++)
+		pthread_join(plugin.threads[i], 0);
+	free(plugin.threads);
+	free(plugin.queue);
+	prog_state.jobs_failed += plugin.failed;
+	return plugin.failed;
+}
+
+/* expand the placeholders of source for the given line into dest.
+   returns the number of substitutions done, -1 on out of buffer.
+   dest is always overwritten. if no substitutions were done, it contains a
+   copy of source. */
+static int subst_arg(char *dest, size_t dest_size, char *source,
+		     char *line, size_t line_size, unsigned long long lineno) {
+	return jobflow_subst(dest, dest_size, source, line, line_size, lineno,
+	                     prog_state.fields ? prog_state.delim : JOBFLOW_NO_FIELDS, &fields);
+}
+
+/* create the directories leading to path, like mkdir -p "$(dirname path)".
+   the last created directory is remembered, so runs writing lots of files
+   into the same directory don't cost extra syscalls. */
+static int make_parent_dirs(char *path) {
+	static char last[4096];
+	char *p, *slash = strrchr(path, '/');
+	if(!slash || slash == path) return 0;
+	*slash = 0;
+	if(!strcmp(last, path)) {
+		*slash = '/';
+		return 0;
+	}
+	for(p = path + 1; ; p++) {
+		if(*p == '/' || !*p) {
+			char c = *p;
+			*p = 0;
+			if(mkdir(path, 0777) == -1 && errno != EEXIST) {
+				perror("mkdir");
+				*p = c;
+				*slash = '/';
+				return -1;
+			}
+			*p = c;
+			if(!c) break;
+		}
+	}
+	snprintf(last, sizeof last, "%s", path);
+	*slash = '/';
 	return 0;
 }
-static char* mystrnrchr(const char *in, int ch, size_t end) {
-	const char *e = in+end-1;
-	const char *p = in;
-	while(p != e && *e != ch) e--;
-	if(*e == ch) return (char*)e;
+
+/* -cache: memoize succeeded commands. the key is a hash of the substituted
+   argv, with -cachestat also of the size and mtime of the file named by
+   the line. a second, differently computed hash of the same data is
+   stored with it, so that a colliding key isn't taken for a hit. the
+   index file is an open addressing table, mmap'ed so lookups are O(1)
+   without reading it, the captured -buffered output of the jobs is
+   appended to FILE.data. expired entries, and with -cachemax the oldest
+   ones, are evicted when the cache is opened, by copying the remaining
+   entries into a new data file and rebuilding the table. */
+#define CACHE_MAGIC "JFCACHE2"
+#define CACHE_MIN_SLOTS 65536
+typedef struct {
+	char magic[8];
+	uint64_t nslots, count, data_size;
+} cache_header;
+
+typedef struct {
+	uint64_t key, off; /* key 0 is an empty slot */
+	uint64_t check;
+	uint32_t out_len, err_len;
+	int64_t time; /* last use */
+} cache_entry;
+
+static struct {
+	int fd, data_fd;
+	cache_header *hdr;
+	cache_entry *slots;
+	size_t map_size;
+	char data_path[4096];
+	unsigned long long hits, misses, stored;
+} cache = {.fd = -1, .data_fd = -1};
+
+static void cache_map(uint64_t nslots, int init) {
+	if(cache.hdr) munmap(cache.hdr, cache.map_size);
+	cache.map_size = sizeof(cache_header) + nslots * sizeof(cache_entry);
+	if(init && (ftruncate(cache.fd, 0) == -1 || ftruncate(cache.fd, cache.map_size) == -1)) {
+		perror("ftruncate");
+		die("could not create cache\n");
+	}
+	cache.hdr = mmap(0, cache.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, cache.fd, 0);
+	if(cache.hdr == MAP_FAILED) {
+		perror("mmap");
+		die("could not map cache\n");
+	}
+	cache.slots = (cache_entry*)(cache.hdr + 1);
+	if(init) {
+		memcpy(cache.hdr->magic, CACHE_MAGIC, 8);
+		cache.hdr->nslots = nslots;
+	}
+}
+
+static cache_entry* cache_slot(uint64_t key) {
+	uint64_t mask = cache.hdr->nslots - 1, h = key & mask;
+	while(cache.slots[h].key && cache.slots[h].key != key) h = (h + 1) & mask;
+	return &cache.slots[h];
+}
+
+static int cmp_cache_time(const void *a, const void *b) {
+	const cache_entry *x = a, *y = b;
+	return (x->time < y->time) - (x->time > y->time);
+}
+
+static int cache_expired(cache_entry *e, time_t now) {
+	return prog_state.cache_age && e->time < now - (time_t) prog_state.cache_age;
+}
+
+/* copy len bytes at off of fd to the end of fd2 */
+static int copy_data(int fd, uint64_t off, int fd2, uint64_t len) {
+	char buf[64*1024];
+	while(len) {
+		ssize_t n = pread(fd, buf, len < sizeof buf ? len : sizeof buf, off);
+		if(n <= 0) return -1;
+		if(write(fd2, buf, n) != n) return -1;
+		off += n;
+		len -= n;
+	}
 	return 0;
 }
-static char* mystrnrchr_chk(const char *in, int ch, size_t end) {
-	if(!end) return 0;
-	return mystrnrchr(in, ch, end);
+
+/* rebuild the cache with nslots slots, dropping expired entries, and if
+   the output is bigger than -cachemax, the least recently used ones until
+   it fits into 3/4 of it. */
+static void cache_rebuild(uint64_t nslots) {
+	uint64_t i, n = 0, size = 0, max = prog_state.cache_max / 4 * 3;
+	time_t now = time(0);
+	char tmp[4096 + 8];
+	cache_entry *live = malloc((cache.hdr->count + 1) * sizeof(cache_entry));
+	int fd;
+
+	if(!live) die("out of memory\n");
+	for(i = 0; i < cache.hdr->nslots; i++)
+		if(cache.slots[i].key && !cache_expired(&cache.slots[i], now))
+			live[n++] = cache.slots[i];
+	qsort(live, n, sizeof(cache_entry), cmp_cache_time);
+	snprintf(tmp, sizeof tmp, "%s.tmp", cache.data_path);
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if(fd == -1) {
+		perror("open");
+		die("could not rebuild cache\n");
+	}
+	for(i = 0; i < n; i++) {
+		uint64_t len = (uint64_t) live[i].out_len + live[i].err_len;
+		if((max && size + len > max) || live[i].off + len > cache.hdr->data_size ||
+		   copy_data(cache.data_fd, live[i].off, fd, len)) {
+			live[i].key = 0;
+			continue;
+		}
+		live[i].off = size;
+		size += len;
+	}
+	if(rename(tmp, cache.data_path) == -1) {
+		perror("rename");
+		die("could not rebuild cache\n");
+	}
+	close(cache.data_fd);
+	cache.data_fd = fd;
+	while(nslots < n * 2) nslots *= 2;
+	cache_map(nslots, 1);
+	cache.hdr->data_size = size;
+	for(i = 0; i < n; i++) if(live[i].key) {
+		*cache_slot(live[i].key) = live[i];
+		cache.hdr->count++;
+	}
+	free(live);
 }
 
-static int need_linecounter(void) {
-	return !!prog_state.skip || prog_state.statefile ||
-	       prog_state.use_seqnr || prog_state.count != -1UL;
+static void cache_open(void) {
+	struct stat st;
+	uint64_t i, nslots;
+	time_t now = time(0);
+	int rebuild = 0;
+
+	snprintf(cache.data_path, sizeof cache.data_path, "%s.data", prog_state.cache);
+	cache.fd = open(prog_state.cache, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	cache.data_fd = open(cache.data_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if(cache.fd == -1 || cache.data_fd == -1) {
+		perror("open");
+		die("could not open cache\n");
+	}
+	if(flock(cache.fd, LOCK_EX | LOCK_NB) == -1)
+		die("cache %s is in use by another jobflow\n", prog_state.cache);
+	if(fstat(cache.fd, &st) == -1 || !st.st_size) {
+		cache_map(CACHE_MIN_SLOTS, 1);
+		return;
+	}
+	if((size_t) st.st_size < sizeof(cache_header))
+		die("%s is not a jobflow cache\n", prog_state.cache);
+	cache_map(0, 0);
+	nslots = cache.hdr->nslots;
+	if(memcmp(cache.hdr->magic, CACHE_MAGIC, 8) || !nslots || (nslots & (nslots - 1)) ||
+	   (uint64_t) st.st_size != sizeof(cache_header) + nslots * sizeof(cache_entry))
+		die("%s is not a jobflow cache\n", prog_state.cache);
+	cache_map(nslots, 0);
+	/* appends go to the end of the data file, which is only longer than
+	   recorded if a previous run got killed while storing */
+	cache.hdr->data_size = lseek(cache.data_fd, 0, SEEK_END);
+	if(prog_state.cache_max && cache.hdr->data_size > prog_state.cache_max) rebuild = 1;
+	for(i = 0; !rebuild && i < nslots; i++)
+		if(cache.slots[i].key && cache_expired(&cache.slots[i], now)) rebuild = 1;
+	if(rebuild) cache_rebuild(CACHE_MIN_SLOTS);
 }
-static size_t count_linefeeds(const char *buf, size_t len) {
-	const char *p = buf, *e = buf+len;
-	size_t cnt = 0;
+
+/* multiply-xorshift, unrelated to FNV-1a so collisions of both are independent */
+static uint64_t cache_check_update(uint64_t h, const void *data, size_t len) {
+	const unsigned char *p = data, *e = p + len;
 	while(p < e) {
-		if(*p == '\n') cnt++;
-		p++;
+		h = (h + *p++) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 32;
 	}
-	return cnt;
+	return h;
 }
 
-static int match_eof(char* inbuf, size_t len) {
-	if(!prog_state.eof_marker) return 0;
-	size_t l = strlen(prog_state.eof_marker);
-	return l == len-1 && !memcmp(prog_state.eof_marker, inbuf, l);
+/* returns the key, and stores the check hash into check */
+static uint64_t cache_hash(char *line, uint64_t *check) {
+	uint64_t h = HASH64_INIT, c = 0;
+	size_t i;
+	struct stat st;
+	for(i = 0; prog_state.cmd_argv[i]; i++) {
+		size_t len = strlen(prog_state.cmd_argv[i]) + 1;
+		h = hash64_update(h, prog_state.cmd_argv[i], len);
+		c = cache_check_update(c, prog_state.cmd_argv[i], len);
+	}
+	if(prog_state.cache_stat && stat(line, &st) == 0) {
+		int64_t v[3] = {st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+		h = hash64_update(h, v, sizeof v);
+		c = cache_check_update(c, v, sizeof v);
+	}
+	*check = c;
+	return h ? h : 1;
 }
 
-static inline int islb(int p) { return p == '\n' || p == '\r'; }
-static void chomp(char *s, size_t *len) {
-	while(*len && islb(s[*len-1])) s[--(*len)] = 0;
+static void cache_replay(int fd, uint64_t off, uint64_t len, FILE *out) {
+	char buf[64*1024];
+	while(len) {
+		ssize_t n = pread(fd, buf, len < sizeof buf ? len : sizeof buf, off);
+		if(n <= 0) {
+			perror("cache");
+			return;
+		}
+		fwrite(buf, 1, n, out);
+		off += n;
+		len -= n;
+	}
+	fflush(out);
 }
 
-static int process_failed(int retval) {
-	return WIFSIGNALED(retval) ||
-	       (WIFEXITED(retval) && WEXITSTATUS(retval));
+/* if the substituted command succeeded before, replay its output and
+   return 1. otherwise remember the key for cache_store(). */
+static int cache_lookup(char *line) {
+	uint64_t check, key = cache_hash(line, &check);
+	cache_entry *e = cache_slot(key);
+	time_t now = time(0);
+	if(!e->key || e->check != check || cache_expired(e, now) ||
+	   e->off + e->out_len + e->err_len > cache.hdr->data_size) {
+		cache.misses++;
+		prog_state.cache_key = key;
+		prog_state.cache_check = check;
+		return 0;
+	}
+	cache.hits++;
+	e->time = now;
+	cache_replay(cache.data_fd, e->off, e->out_len, stdout);
+	cache_replay(cache.data_fd, e->off + e->out_len, e->err_len, stderr);
+	return 1;
+}
+
+/* append the file fn to the data file and store its length in len.
+   returns 0 on error. */
+static int cache_append(const char *fn, uint32_t *len) {
+	int fd = open(fn, O_RDONLY | O_CLOEXEC), ret = 1;
+	struct stat st;
+	*len = 0;
+	if(fd == -1) return errno == ENOENT;
+	if(fstat(fd, &st) == -1 || st.st_size >= UINT32_MAX ||
+	   copy_data(fd, 0, cache.data_fd, st.st_size))
+		ret = 0;
+	else
+		*len = st.st_size;
+	close(fd);
+	return ret;
+}
+
+/* record a succeeded job, with its output if -buffered. called before
+   the output files are dumped. */
+static void cache_store(size_t job_id) {
+	job_info *job = sblist_get(prog_state.job_infos, job_id);
+	cache_entry *e, ne = {.key = job->cache_key, .check = job->cache_check, .time = time(0)};
+	char fn[256];
+
+	if(!job->cache_key) return;
+	if((cache.hdr->count + 1) * 2 > cache.hdr->nslots)
+		cache_rebuild(cache.hdr->nslots * 2);
+	ne.off = cache.hdr->data_size;
+	if(prog_state.buffered &&
+	   ((makeLogfilename(fn, sizeof fn, job_id, 0) && !cache_append(fn, &ne.out_len)) ||
+	    (!prog_state.join_output && makeLogfilename(fn, sizeof fn, job_id, 1) &&
+	     !cache_append(fn, &ne.err_len)))) {
+		perror("cache");
+		if(ftruncate(cache.data_fd, ne.off) == -1) perror("ftruncate");
+		return;
+	}
+	cache.hdr->data_size += (uint64_t) ne.out_len + ne.err_len;
+	e = cache_slot(ne.key);
+	if(!e->key) cache.hdr->count++;
+	*e = ne;
+	cache.stored++;
 }
 
 #define MAX_SUBSTS 16
-static int dispatch_line(char* inbuf, size_t len, char** argv) {
-	char subst_buf[MAX_SUBSTS][4096];
-	static unsigned spinup_counter = 0;
+static int run_line(char* line, size_t line_size, unsigned long long lineno, char** argv);
+
+/* lookahead window: instead of launching lines in input order, keep up to
+   -lookahead lines pending and launch the one with the highest estimated
+   cost first, so that big items don't end up at the tail of the run.
+   lines which got overtaken too often are launched regardless of their cost,
+   so the window can't starve. */
+static double line_cost(char *line, size_t len) {
+	struct stat st;
+	char buf[64], *f;
+	size_t flen;
+	switch(prog_state.cost_mode) {
+	case COST_SIZE:
+		if(prog_state.walk) return prog_state.cost_hint;
+		return stat(line, &st) == -1 ? 0 : (double) st.st_size;
+	case COST_FIELD:
+		if(!(f = get_field(line, len, prog_state.cost_field, &flen))) return 0;
+		if(flen >= sizeof buf) flen = sizeof(buf) - 1;
+		memcpy(buf, f, flen);
+		buf[flen] = 0;
+		return strtod(buf, 0);
+	default:
+		break;
+	}
+	return 0;
+}
+
+static int window_launch(char** argv) {
+	size_t i, best = 0, n = sblist_getsize(prog_state.window);
+	pending_line *pl, item;
+	if(!n) return 1;
+	pl = sblist_get(prog_state.window, 0);
+	if(prog_state.lineno - pl->lineno < prog_state.lookahead * 4) {
+		for(i = 1; i < n; i++) {
+			pending_line *cand = sblist_get(prog_state.window, i);
+			if(cand->cost > pl->cost) {
+				pl = cand;
+				best = i;
+			}
+		}
+	}
+	item = *pl;
+	sblist_delete(prog_state.window, best);
+	int ret = run_line(item.line, item.len, item.lineno, argv);
+	free(item.line);
+	return ret;
+}
 
+static int window_add(char* line, size_t len, char** argv) {
+	pending_line pl = {.lineno = prog_state.lineno, .len = len};
+	if(!(pl.line = malloc(len + 1))) die("out of memory\n");
+	memcpy(pl.line, line, len);
+	pl.line[len] = 0;
+	pl.cost = line_cost(pl.line, len);
+	sblist_add(prog_state.window, &pl);
+	if(sblist_getsize(prog_state.window) < prog_state.lookahead) return 1;
+	return window_launch(argv);
+}
+
+static int flush_window(char** argv) {
+	while(!sblist_empty(prog_state.window))
+		if(!window_launch(argv)) return 0;
+	return 1;
+}
+
+/* number of the last line for which all previous lines have been launched */
+static unsigned long long launched_lineno(void) {
+	if(prog_state.window && !sblist_empty(prog_state.window))
+		return ((pending_line*) sblist_get(prog_state.window, 0))->lineno - 1;
+	return prog_state.lineno;
+}
+
+/* -dedup: drop lines which were seen before in this run. the set of
+   seen lines is an open addressing table of their 64 bit hashes, so a
+   line costs 8 to 16 bytes regardless of its length. with -dedupbloom N
+   a bloom filter sized for N lines at the -dedupfp false positive rate
+   is used instead, whose memory use is fixed; a line which wasn't seen
+   before is dropped with that probability. */
+static struct {
+	uint64_t *set;
+	size_t mask, count;
+	unsigned char *bits;
+	uint64_t nbits;
+	unsigned k;
+} dedup;
+
+/* murmur3 finalizer, spreads the fnv hash over all bits */
+static uint64_t mix64(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static void dedup_init(void) {
+	if(prog_state.dedup_bloom) {
+		/* the optimal size and number of hash functions for n items */
+		double n = prog_state.dedup_bloom, ln2 = 0.6931471805599453;
+		dedup.nbits = (uint64_t)(-n * log(prog_state.dedup_fp) / (ln2 * ln2)) + 64;
+		dedup.k = (unsigned)(dedup.nbits / n * ln2 + 0.5);
+		if(!dedup.k) dedup.k = 1;
+		dedup.bits = calloc(dedup.nbits / 8 + 1, 1);
+	} else {
+		dedup.mask = 64*1024 - 1;
+		dedup.set = calloc(dedup.mask + 1, sizeof(uint64_t));
+	}
+	if(!dedup.bits && !dedup.set) die("out of memory\n");
+}
+
+static uint64_t* dedup_slot(uint64_t *set, size_t mask, uint64_t h) {
+	size_t i = mix64(h) & mask;
+	while(set[i] && set[i] != h) i = (i + 1) & mask;
+	return &set[i];
+}
+
+/* returns whether the line was seen before, and adds it to the set */
+static int dedup_seen(char *line, size_t len) {
+	uint64_t h;
+	len = rec_len(line, len);
+	h = hash64(line, len);
+	if(dedup.bits) {
+		uint64_t h2 = mix64(h) | 1;
+		unsigned i, seen = 1;
+		for(i = 0; i < dedup.k; i++) {
+			uint64_t b = (h + i * h2) % dedup.nbits;
+			if(!(dedup.bits[b / 8] & (1 << (b % 8)))) {
+				seen = 0;
+				dedup.bits[b / 8] |= 1 << (b % 8);
+			}
+		}
+		return seen;
+	}
+	if(!h) h = 1;
+	uint64_t *slot = dedup_slot(dedup.set, dedup.mask, h);
+	if(*slot) return 1;
+	*slot = h;
+	if(++dedup.count * 4 > dedup.mask * 3) {
+		size_t i, mask = dedup.mask * 2 + 1;
+		uint64_t *set = calloc(mask + 1, sizeof(uint64_t));
+		if(!set) die("out of memory\n");
+		for(i = 0; i <= dedup.mask; i++)
+			if(dedup.set[i]) *dedup_slot(set, mask, dedup.set[i]) = dedup.set[i];
+		free(dedup.set);
+		dedup.set = set;
+		dedup.mask = mask;
+	}
+	return 0;
+}
+
+static int dispatch_line(char* inbuf, size_t len, char** argv) {
 	if(!prog_state.bulk_bytes)
 		prog_state.lineno++;
 	else if(need_linecounter()) {
-		prog_state.lineno += count_linefeeds(inbuf, len);
+		prog_state.lineno += count_records(inbuf, len);
+	}
+
+	/* duplicates keep their line number, and count towards -skip, so
+	   {#} and -resume refer to the input as it is */
+	if(prog_state.dedup && dedup_seen(inbuf, len)) {
+		if(prog_state.skip) prog_state.skip--;
+		else prog_state.dedup_dropped++;
+		return 1;
 	}
 
 	if(prog_state.skip) {
@@ -728,16 +3586,18 @@ static int dispatch_line(char* inbuf, size_t len, char** argv) {
 			prog_state.skip--;
 			return 1;
 		} else {
-			while(len && prog_state.skip) {
-				char *q = mystrnchr(inbuf, '\n', len);
-				if(q) {
-					ptrdiff_t diff = (q - inbuf) + 1;
-					inbuf += diff;
-					len -= diff;
-					prog_state.skip--;
-				} else {
-					return 1;
-				}
+			if(prog_state.recsize) {
+				size_t n = len / prog_state.recsize;
+				if(n > prog_state.skip) n = prog_state.skip;
+				inbuf += n * prog_state.recsize;
+				len -= n * prog_state.recsize;
+				prog_state.skip -= n;
+			} else while(len && prog_state.skip) {
+				char *q = rec_next(inbuf, len);
+				if(!q) return 1;
+				len -= q - inbuf;
+				inbuf = q;
+				prog_state.skip--;
 			}
 			if(!len) return 1;
 		}
@@ -746,51 +3606,63 @@ static int dispatch_line(char* inbuf, size_t len, char** argv) {
 		--prog_state.count;
 	}
 
-	if(!prog_state.cmd_startarg) {
+	if(!prog_state.cmd_startarg && !prog_state.plugin) {
 		write_all(1, inbuf, len);
 		return 1;
 	}
 
 	if(!prog_state.pipe_mode)
-		chomp(inbuf, &len);
+		inbuf = rec_chomp(inbuf, &len);
+
+	if(prog_state.lookahead)
+		return window_add(inbuf, len, argv);
+
+	return run_line(inbuf, len, prog_state.lineno, argv);
+}
+
+/* make room for a substitution into *buf which didn't fit: 4096 bytes at
+   first, then twice as much each time. returns 0 if out of memory. */
+static int subst_grow(char **buf, size_t *size) {
+	size_t n = *size ? *size * 2 : 4096;
+	char *p;
+	if(*size && !(p = realloc(*buf, n))) return 0;
+	if(!*size && !(p = malloc(n))) return 0;
+	*buf = p;
+	*size = n;
+	return 1;
+}
 
-	char *line = inbuf;
-	size_t line_size = len;
+static int run_line(char* line, size_t line_size, unsigned long long lineno, char** argv) {
+	/* grown for long lines, see subst_grow() */
+	static char *subst_buf[MAX_SUBSTS];
+	static size_t subst_size[MAX_SUBSTS];
+	static unsigned spinup_counter = 0;
+	char *dir_failed = 0;
 	int ret;
+	uint64_t t = trace_now();
 
-	if(prog_state.subst_entries) {
+	if(prog_state.halted) {
+		halt_rerun(lineno);
+		return 0;
+	}
+	PROBE3(line_dispatched, lineno, line, line_size);
+	fields_reset();
+	if(prog_state.subst_entries && !prog_state.plugin) {
 		unsigned max_subst = 0;
 		uint32_t* index;
 		sblist_iter(prog_state.subst_entries, index) {
 			if(max_subst >= MAX_SUBSTS) break;
-			char *source = argv[*index + prog_state.cmd_startarg];
-			size_t source_len = strlen(source);
-			ret = substitute_all(subst_buf[max_subst], 4096,
-					     source, source_len,
-					     "{}", 2,
-					     line, line_size);
+			ret = -1;
+			while(!subst_size[max_subst] ||
+			      (ret = subst_arg(subst_buf[max_subst], subst_size[max_subst],
+					argv[*index + prog_state.cmd_startarg],
+					line, line_size, lineno)) == -1)
+				if(!subst_grow(&subst_buf[max_subst], &subst_size[max_subst]))
+					break;
 			if(ret == -1) {
 				too_long:
 				dprintf(2, "fatal: line too long for substitution: %s\n", line);
 				return 0;
-			} else if(!ret) {
-				char* lastdot = mystrnrchr_chk(line, '.', line_size);
-				size_t tilLastDot = line_size;
-				if(lastdot) tilLastDot = lastdot - line;
-				ret = substitute_all(subst_buf[max_subst], 4096,
-						     source, source_len,
-						     "{.}", 3,
-						     line, tilLastDot);
-				if(ret == -1) goto too_long;
-			}
-			if(!ret) {
-				char lineno[32];
-				sprintf(lineno, "%llu", prog_state.lineno);
-				ret = substitute_all(subst_buf[max_subst], 4096,
-						     source, source_len,
-						     "{#}", 3,
-						     lineno, strlen(lineno));
-				if(ret == -1) goto too_long;
 			}
 			if(ret) {
 				prog_state.cmd_argv[*index] = subst_buf[max_subst];
@@ -799,6 +3671,22 @@ static int dispatch_line(char* inbuf, size_t len, char** argv) {
 		}
 	}
 
+	if(prog_state.out_template &&
+	   subst_arg(prog_state.out_path, sizeof prog_state.out_path, prog_state.out_template, line, line_size, lineno) == -1)
+		goto too_long;
+	if(prog_state.err_template &&
+	   subst_arg(prog_state.err_path, sizeof prog_state.err_path, prog_state.err_template, line, line_size, lineno) == -1)
+		goto too_long;
+	if(prog_state.out_template && make_parent_dirs(prog_state.out_path))
+		dir_failed = prog_state.out_path;
+	else if(prog_state.err_template && make_parent_dirs(prog_state.err_path))
+		dir_failed = prog_state.err_path;
+	if(dir_failed) {
+		/* make_parent_dirs() printed why */
+		dprintf(2, "fatal: could not create the directory of %s\n", dir_failed);
+		return 0;
+	}
+	trace_end(TR_SUBST, t, lineno);
 
 	if(prog_state.delayedspinup_interval && spinup_counter < (prog_state.numthreads * 2)) {
 		msleep(rand() % (prog_state.delayedspinup_interval + 1));
@@ -806,16 +3694,32 @@ static int dispatch_line(char* inbuf, size_t len, char** argv) {
 	}
 
 	ret = 1;
-	if(free_slots())
-		launch_job(prog_state.threads_running, prog_state.cmd_argv);
+	prog_state.launch_lineno = lineno;
+	if(prog_state.cache && cache_lookup(line))
+		;	/* the output of an earlier run was replayed */
+	else if(prog_state.plugin)
+		ret = plugin_submit(line, line_size, lineno);
+	else if(prog_state.pipe_mode && (prog_state.part_field || prog_state.part_end || prog_state.merge)) {
+		/* every worker owns a part of the key space, or takes part in the
+		   merge, so all of them need to be running from the start. */
+		size_t n = free_slots();
+		while(n--) launch_job(find_free_slot(), prog_state.cmd_argv);
+	} else if(free_slots())
+		launch_job(find_free_slot(), prog_state.cmd_argv);
 	else if(!prog_state.pipe_mode) {
 		int retval;
-		launch_job(reap_child(&retval), prog_state.cmd_argv);
-		ret = !process_failed(retval);
+		size_t i = reap_child(&retval);
+		if(prog_state.halted) {
+			halt_rerun(lineno);
+			return 0;
+		}
+		launch_job(i, prog_state.cmd_argv);
+		/* without a halt policy, the first failure ends the input */
+		ret = prog_state.halt || prog_state.halt_percent > 0 || !process_failed(retval);
 	}
 
 	if(prog_state.statefile && (prog_state.delayedflush == 0 || free_slots() == 0)) {
-		write_statefile(prog_state.lineno, prog_state.temp_state);
+		write_statefile(launched_lineno(), prog_state.temp_state, prog_state.statefile);
 	}
 
 	if(prog_state.pipe_mode)
@@ -824,112 +3728,1334 @@ static int dispatch_line(char* inbuf, size_t len, char** argv) {
 	return ret;
 }
 
-int main(int argc, char** argv) {
-	unsigned i;
-
-	char tempdir_buf[256];
-
-	srand(time(NULL));
-
-	if(argc > 4096) argc = 4096;
-
-	prog_state.threads_running = 0;
-
-	if(parse_args(argc, argv)) return 1;
-
-	if(prog_state.statefile)
-		snprintf(prog_state.temp_state, sizeof(prog_state.temp_state), "%s.%u", prog_state.statefile, (unsigned) getpid());
-
-	prog_state.tempdir = NULL;
+typedef int (*line_handler)(char* line, size_t len, char** argv);
 
-	if(prog_state.buffered) {
-		prog_state.tempdir = tempdir_buf;
-		if(mktempdir("jobflow", tempdir_buf, sizeof(tempdir_buf)) == 0) {
-			perror("mkdtemp");
-			die("could not create tempdir\n");
-		}
-	} else {
-		/* if the stdout/stderr fds are not in O_APPEND mode,
-		   the dup()'s of the fds in posix_spawn can cause different
-		   file positions, causing the different processes to overwrite each others output.
-		   testcase:
-		   seq 100 | ./jobflow.out -threads=100 -exec echo {} > test.tmp ; wc -l test.tmp
-		*/
-		if(fcntl(1, F_SETFL, O_APPEND) == -1) perror("fcntl");
-		if(fcntl(2, F_SETFL, O_APPEND) == -1) perror("fcntl");
-	}
+/* -recsize: skip the records to -skip by seeking past them, if the input
+   is a file. */
+static void seek_skip(int fd) {
+	struct stat st;
+	off_t pos;
+	unsigned long long n = prog_state.skip;
+	if(!prog_state.recsize || !n || prog_state.dedup || prog_state.eof_marker ||
+	   fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	   (pos = lseek(fd, 0, SEEK_CUR)) == -1)
+		return;
+	if(st.st_size < pos) return;
+	if(n > (st.st_size - pos) / prog_state.recsize)
+		n = (st.st_size - pos) / prog_state.recsize;
+	if(lseek(fd, n * prog_state.recsize, SEEK_CUR) == -1) return;
+	prog_state.lineno += n;
+	prog_state.skip -= n;
+}
 
-	if(prog_state.cmd_startarg) {
-		for(i = prog_state.cmd_startarg; i < (unsigned) argc; i++) {
-			prog_state.cmd_argv[i - prog_state.cmd_startarg] = argv[i];
-		}
-		prog_state.cmd_argv[argc - prog_state.cmd_startarg] = NULL;
+/* make the anonymous mapping *p of *size bytes hold at least need bytes */
+static int map_grow(char **p, size_t *size, size_t need) {
+	size_t n = *size * 2;
+	void *q;
+	if(need <= *size) return 1;
+	if(n < need) n = need;
+	n = (n + 4095) & ~(size_t)4095;
+	if(*p) q = mremap(*p, *size, n, MREMAP_MAYMOVE);
+	else q = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if(q == MAP_FAILED) {
+		perror("mremap");
+		return 0;
 	}
+	*p = q;
+	*size = n;
+	return 1;
+}
 
-	prog_state.job_infos = sblist_new(sizeof(job_info), prog_state.numthreads);
-	init_queue();
-
-	prog_state.lineno = 0;
-
+/* read fd until EOF, split the input into records (in pipe mode with -bulk
+   into chunks ending on a record boundary), and pass them to emit.
+   returns 1 if the input was consumed until EOF or the eof marker,
+   0 on error or if emit returned 0. */
+static int split_input(int fd, line_handler emit, char** argv) {
 	size_t left = 0, bytes_read = 0;
-	const size_t chunksize = prog_state.bulk_bytes ? prog_state.bulk_bytes : 16*1024;
+	const size_t chunksize = input_chunksize();
 
-	char *mem = mmap(NULL, chunksize*2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-	char *buf1 = mem;
-	char *buf2 = mem+chunksize;
+	/* nbufs chunks, each preceded by room for the incomplete line at the
+	   end of the chunk before. more than one with -uring, which reads
+	   ahead into the next ones. the ring belongs to the dispatcher, so
+	   not for the -readahead thread. */
+	const bool use_uring = uring.fd != -1 && emit == dispatch_line;
+	const size_t nbufs = use_uring ? uring_reads(fd) : 1;
+	size_t cur = 0;
+
+	char *mem = mmap(NULL, chunksize*2*nbufs, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	char *prev = mem+chunksize;
 	char *in, *inbuf;
+	/* a record which doesn't fit into a chunk is read into big */
+	char *big = 0;
+	size_t bigsize = 0;
 
-	int exitcode = 1;
+	int ret = 0;
+
+	if(mem == MAP_FAILED) {
+		perror("mmap");
+		return 0;
+	}
+	if(nbufs > 1)
+		uring_reads_begin(fd, mem, chunksize);
+	/* with -uring, lines passed to the workers are written once a chunk
+	   was split, but not if they're copied somewhere first */
+	uring.batch = use_uring && prog_state.pipe_mode && !capture_output() &&
+		!prog_state.lookahead && !prog_state.coalesce;
 
 	while(1) {
-		inbuf = buf1+chunksize-left;
-		memcpy(inbuf, buf2+bytes_read-left, left);
-		ssize_t n = read(0, buf2, chunksize);
+		char *buf = mem+(2*cur+1)*chunksize;
+		inbuf = buf-left;
+		memcpy(inbuf, prev+bytes_read-left, left);
+		if(big) {
+			/* the rest of it was copied, give the memory back */
+			munmap(big, bigsize);
+			big = 0;
+			bigsize = 0;
+		}
+		if(prog_state.coalesce && emit == dispatch_line)
+			stage_wait_input(fd);
+		uint64_t t = trace_now();
+		ssize_t n = nbufs > 1 ? uring_read(cur) : read(fd, buf, chunksize);
+		trace_end(TR_READ, t, n > 0 ? n : 0);
 		if(n == -1) {
+			if(errno == EINTR) continue;
 			perror("read");
 			goto out;
 		}
+		PROBE1(read_chunk, n);
+		prev = buf;
+		cur = (cur + 1) % nbufs;
 		bytes_read = n;
 		left += n;
 		in = inbuf;
+		split:
 		while(left) {
 			char *p;
 			if(prog_state.pipe_mode && prog_state.bulk_bytes)
-				p = mystrnrchr(in, '\n', left);
+				p = rec_last(in, left);
 			else
-				p = mystrnchr (in, '\n', left);
+				p = rec_next(in, left);
 
 			if(!p) break;
-			ptrdiff_t diff = (p - in) + 1;
+			ptrdiff_t diff = p - in;
 			if(match_eof(in, diff)) {
-				exitcode = 0;
+				ret = 1;
 				goto out;
 			}
-			if(!dispatch_line(in, diff, argv))
+			if(!emit(in, diff, argv))
 				goto out;
 			left -= diff;
 			in += diff;
 		}
+		if(uring.batch) uring_flush();
 		if(!n) {
-			if(left && !match_eof(in, left)) dispatch_line(in, left, argv);
+			if(left && !match_eof(in, left)) emit(in, left, argv);
 			break;
 		}
 		if(left > chunksize) {
-			dprintf(2, "error: input line length exceeds buffer size\n");
-			goto out;
+			/* a record longer than a chunk. it's collected in big, which
+			   grows until the record's end was read, and split like a
+			   chunk then. the reads go there directly, so the record is
+			   copied only once, not with every chunk. */
+			size_t len = left;
+			if(!map_grow(&big, &bigsize, len + chunksize)) goto out;
+			memcpy(big, in, len);
+			do {
+				/* its separator may begin in the data read before */
+				size_t from = prog_state.rs_len && len >= prog_state.rs_len ?
+				              len - prog_state.rs_len + 1 : 0;
+				if(!map_grow(&big, &bigsize, len + chunksize)) goto out;
+				t = trace_now();
+				if(nbufs > 1) {
+					n = uring_read(cur);
+					if(n > 0) memcpy(big + len, mem+(2*cur+1)*chunksize, n);
+					cur = (cur + 1) % nbufs;
+				} else
+					n = read(fd, big + len, chunksize);
+				trace_end(TR_READ, t, n > 0 ? n : 0);
+				if(n == -1) {
+					if(errno == EINTR) continue;
+					perror("read");
+					goto out;
+				}
+				PROBE1(read_chunk, n);
+				len += n;
+				if(rec_next(big + from, len - from)) break;
+			} while(n);
+			prev = in = big;
+			bytes_read = left = len;
+			goto split;
 		}
 	}
 
-	exitcode = 0;
+	ret = 1;
 
 	out:
+	if(uring.batch) {
+		uring_flush();
+		uring.batch = 0;
+	}
+	if(nbufs > 1)
+		uring_reads_end();
+	if(big) munmap(big, bigsize);
+	munmap(mem, chunksize*2*nbufs);
+	return ret;
+}
+
+/* -readahead: a reader thread splits the input and puts the lines into a
+   lock-free single producer/single consumer ring, from which the
+   dispatcher takes them. so stdin keeps being drained while all slots are
+   busy. when the ring is full, lines go to the -spill file instead,
+   until the dispatcher has caught up with it.
+   records in the ring are a 8 byte header holding the length, followed by
+   the nul-terminated data, padded to 8 bytes. a header of RING_WRAP marks
+   that the next record starts at the beginning of the buffer.
+   every line in the ring is older than every line in the spill file,
+   because the reader only uses the ring while the spill file is empty. */
+#define RING_WRAP UINT64_MAX
+#define RING_ALIGN(x) (((x) + 7) & ~(size_t)7)
+static struct {
+	char *buf;
+	size_t size;
+	_Atomic size_t head, tail; /* consumer and producer positions */
+	_Atomic size_t spill_r, spill_w;
+	_Atomic int waiting; /* one side sleeps on cond */
+	_Atomic int done; /* reader finished, 1 on error, 2 on success */
+	int spill_fd;
+	size_t spill_punched, cur, spill_cur;
+	char *spill_buf;
+	size_t spill_bufsize;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+} rd = {
+	.spill_fd = -1,
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void rd_wake(void) {
+	if(!atomic_load(&rd.waiting)) return;
+	pthread_mutex_lock(&rd.mtx);
+	pthread_cond_broadcast(&rd.cond);
+	pthread_mutex_unlock(&rd.mtx);
+}
+
+/* sleep until the other side made progress. cond is rechecked with the
+   waiting flag set, so a wakeup can't get lost in between. */
+static void rd_wait(int (*cond)(void)) {
+	pthread_mutex_lock(&rd.mtx);
+	atomic_fetch_add(&rd.waiting, 1);
+	while(!cond()) pthread_cond_wait(&rd.cond, &rd.mtx);
+	atomic_fetch_sub(&rd.waiting, 1);
+	pthread_mutex_unlock(&rd.mtx);
+}
+
+static size_t rd_need; /* bytes the producer waits for */
+static int rd_has_room(void) {
+	size_t used = atomic_load(&rd.tail) - atomic_load(&rd.head);
+	return rd.size - used >= rd_need;
+}
+static int rd_spill_has_room(void) {
+	return atomic_load(&rd.spill_w) - atomic_load(&rd.spill_r) < prog_state.spill_max;
+}
+static int rd_has_data(void) {
+	return atomic_load(&rd.head) != atomic_load(&rd.tail) ||
+	       atomic_load(&rd.spill_r) != atomic_load(&rd.spill_w) ||
+	       atomic_load(&rd.done);
+}
+
+static int ring_push(char* line, size_t len, char** argv) {
+	size_t tail = atomic_load(&rd.tail), off = tail % rd.size;
+	size_t need = 8 + RING_ALIGN(len + 1), wrap = 0;
+	(void) argv;
+
+	if(need > rd.size && rd.spill_fd == -1) {
+		dprintf(2, "error: record longer than the -readahead ring, see -spill\n");
+		return 0;
+	}
+
+	if(rd.size - off < need) wrap = rd.size - off;
+	if(atomic_load(&rd.spill_r) == atomic_load(&rd.spill_w)) {
+		size_t used = tail - atomic_load(&rd.head);
+		if(rd.spill_fd == -1 && rd.size - used < wrap + need) {
+			rd_need = wrap + need;
+			rd_wait(rd_has_room);
+			used = tail - atomic_load(&rd.head);
+		}
+		if(rd.size - used >= wrap + need) {
+			if(wrap) {
+				*(uint64_t*)(rd.buf + off) = RING_WRAP;
+				tail += wrap;
+				off = 0;
+			}
+			*(uint64_t*)(rd.buf + off) = len;
+			memcpy(rd.buf + off + 8, line, len);
+			rd.buf[off + 8 + len] = 0;
+			atomic_store(&rd.tail, tail + need);
+			rd_wake();
+			return 1;
+		}
+	}
+	/* ring is full, or older lines are still in the spill file */
+	if(prog_state.spill_max && !rd_spill_has_room())
+		rd_wait(rd_spill_has_room);
+	uint32_t l = len;
+	size_t w = atomic_load(&rd.spill_w);
+	if(pwrite(rd.spill_fd, &l, 4, w) != 4 || pwrite(rd.spill_fd, line, len, w + 4) != (ssize_t) len) {
+		perror("spill");
+		return 0;
+	}
+	atomic_store(&rd.spill_w, w + 4 + len);
+	rd_wake();
+	return 1;
+}
+
+static void* reader_thread(void* arg) {
+	trace_tid = TRACE_TID_READER;
+	int ret = split_input(0, ring_push, arg);
+	atomic_store_explicit(&rd.done, ret + 1, memory_order_release);
+	rd_wake();
+	return 0;
+}
+
+/* get the next line. it stays valid until ring_release(). */
+static int ring_pop(char** line, size_t* len) {
+	while(1) {
+		/* done first: the records the reader pushed before setting it are
+		   then seen by the loads below, so none are left behind */
+		int done = atomic_load_explicit(&rd.done, memory_order_acquire);
+		size_t head = atomic_load(&rd.head);
+		size_t spill_r = atomic_load(&rd.spill_r);
+		size_t spill_w = atomic_load(&rd.spill_w);
+		if(head != atomic_load(&rd.tail)) {
+			size_t off = head % rd.size;
+			uint64_t l = *(uint64_t*)(rd.buf + off);
+			if(l == RING_WRAP) {
+				atomic_store(&rd.head, head + rd.size - off);
+				rd_wake();
+				continue;
+			}
+			*line = rd.buf + off + 8;
+			*len = l;
+			rd.cur = 8 + RING_ALIGN(l + 1);
+			return 1;
+		}
+		if(spill_r != spill_w) {
+			uint32_t l;
+			if(pread(rd.spill_fd, &l, 4, spill_r) != 4) goto spill_err;
+			if(rd.spill_bufsize < l + 1) {
+				free(rd.spill_buf);
+				rd.spill_bufsize = l + 1;
+				if(!(rd.spill_buf = malloc(rd.spill_bufsize))) die("out of memory\n");
+			}
+			if(pread(rd.spill_fd, rd.spill_buf, l, spill_r + 4) != l) goto spill_err;
+			rd.spill_buf[l] = 0;
+			*line = rd.spill_buf;
+			*len = l;
+			rd.cur = 0;
+			rd.spill_cur = 4 + l;
+			return 1;
+		}
+		if(done) return 0;
+		/* don't keep staged lines back while waiting for more */
+		stage_flush_all();
+		rd_wait(rd_has_data);
+	}
+	spill_err:
+	perror("spill");
+	return 0;
+}
+
+static void ring_release(void) {
+	if(rd.cur) atomic_fetch_add(&rd.head, rd.cur);
+	else {
+		size_t r = atomic_fetch_add(&rd.spill_r, rd.spill_cur) + rd.spill_cur;
+		/* give back the disk space of what has been consumed */
+		if(r - rd.spill_punched >= 1024*1024) {
+			size_t end = r & ~(size_t)4095;
+#ifdef FALLOC_FL_PUNCH_HOLE
+			fallocate(rd.spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			          rd.spill_punched, end - rd.spill_punched);
+#endif
+			rd.spill_punched = end;
+		}
+	}
+	rd_wake();
+}
+
+static int readahead_input(char** argv) {
+	pthread_t thread;
+	char *line;
+	size_t len;
+	int ret = 1;
+
+	rd.size = RING_ALIGN(prog_state.readahead);
+	if(!(rd.buf = malloc(rd.size))) die("out of memory\n");
+	if(prog_state.spill) {
+		rd.spill_fd = open(prog_state.spill, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if(rd.spill_fd == -1) {
+			perror("open");
+			die("could not open spill file\n");
+		}
+		unlink(prog_state.spill);
+	}
+	if((errno = pthread_create(&thread, 0, reader_thread, argv))) {
+		perror("pthread_create");
+		return 0;
+	}
+	while(ring_pop(&line, &len)) {
+		ret = dispatch_line(line, len, argv);
+		ring_release();
+		if(!ret) break;
+	}
+	/* if we stopped early, the reader may be blocked on stdin or a full
+	   ring, so it's just left alone. */
+	if(!ret) return 0;
+	pthread_join(thread, 0);
+	free(rd.buf);
+	free(rd.spill_buf);
+	if(rd.spill_fd != -1) close(rd.spill_fd);
+	return atomic_load(&rd.done) == 2;
+}
+
+/* -walk: instead of reading stdin, walk directory trees with -walkthreads
+   threads and dispatch the paths found, like `find ROOT -name GLOB -type T`
+   piped into jobflow, minus the extra process, and with the directory reads
+   and stats done in parallel.
+   directories waiting to be read are kept on a shared stack, so the walk
+   stays mostly depth first and an idle thread picks up any pending subtree.
+   they're opened with openat() relative to their parent when found, so
+   their paths aren't resolved again, unless too many are open already.
+   the paths go to the dispatcher through a bounded queue, together with
+   the file size if -cost size needs it. */
+struct walk_dirent {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+typedef struct {
+	char *path;
+	int fd; /* opened relative to the parent, or -1 to open path */
+} walk_dir_item;
+
+/* max directories waiting to be read with an open fd */
+#define WALK_MAX_FDS 256
+
+static struct {
+	pthread_t *threads;
+	sblist *dirs; /* walk_dir_item of the directories to read */
+	_Atomic size_t dir_fds; /* of them with an fd */
+	size_t busy; /* threads reading a directory */
+	size_t running; /* threads not finished yet */
+	pthread_mutex_t mtx, qmtx;
+	pthread_cond_t dirs_cond, not_empty, not_full;
+	pending_line *queue;
+	size_t qsize, qhead, qcount, producers_waiting;
+	bool consumer_waiting, stop;
+	_Atomic unsigned long errors;
+} walk = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+	.qmtx = PTHREAD_MUTEX_INITIALIZER,
+	.dirs_cond = PTHREAD_COND_INITIALIZER,
+	.not_empty = PTHREAD_COND_INITIALIZER,
+	.not_full = PTHREAD_COND_INITIALIZER,
+};
+
+static void walk_error(const char *path) {
+	dprintf(2, "%s: %s\n", path, strerror(errno));
+	atomic_fetch_add(&walk.errors, 1);
+}
+
+/* paths are queued in batches, so the threads don't fight over the lock */
+#define WALK_BATCH 64
+static _Thread_local pending_line walk_batch[WALK_BATCH];
+static _Thread_local size_t walk_batch_n;
+
+static void walk_flush(void) {
+	size_t i = 0;
+	pthread_mutex_lock(&walk.qmtx);
+	while(i < walk_batch_n) {
+		while(walk.qcount == walk.qsize && !walk.stop) {
+			walk.producers_waiting++;
+			pthread_cond_wait(&walk.not_full, &walk.qmtx);
+			walk.producers_waiting--;
+		}
+		if(walk.stop) break;
+		for(; i < walk_batch_n && walk.qcount < walk.qsize; i++)
+			walk.queue[(walk.qhead + walk.qcount++) % walk.qsize] = walk_batch[i];
+		if(walk.consumer_waiting) pthread_cond_signal(&walk.not_empty);
+	}
+	pthread_mutex_unlock(&walk.qmtx);
+	for(; i < walk_batch_n; i++) free(walk_batch[i].line);
+	walk_batch_n = 0;
+}
+
+static void walk_emit(const char *path, size_t len, double cost) {
+	pending_line *pl = &walk_batch[walk_batch_n++];
+	size_t rl = prog_state.rs_len;
+	*pl = (pending_line) {.cost = cost, .len = len + rl};
+	if(!(pl->line = malloc(len + rl + 1))) die("out of memory\n");
+	memcpy(pl->line, path, len);
+	memcpy(pl->line + len, prog_state.rs, rl);
+	pl->line[len + rl] = 0;
+	if(walk_batch_n == WALK_BATCH) walk_flush();
+}
+
+static walk_dir_item walk_pop_dir(void) {
+	size_t n = sblist_getsize(walk.dirs) - 1;
+	walk_dir_item ret = *(walk_dir_item*) sblist_get(walk.dirs, n);
+	sblist_delete(walk.dirs, n);
+	if(ret.fd != -1) walk.dir_fds--;
+	return ret;
+}
+
+/* queue the directory name in dirfd, whose path is path */
+static void walk_push_dir(int dirfd, const char *name, const char *path) {
+	walk_dir_item it = {.path = strdup(path), .fd = -1};
+	if(!it.path) die("out of memory\n");
+	if(dirfd != AT_FDCWD && walk.dir_fds < WALK_MAX_FDS) {
+		it.fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if(it.fd == -1) {
+			walk_error(path);
+			free(it.path);
+			return;
+		}
+	}
+	pthread_mutex_lock(&walk.mtx);
+	if(it.fd != -1) walk.dir_fds++;
+	sblist_add(walk.dirs, &it);
+	pthread_cond_signal(&walk.dirs_cond);
+	pthread_mutex_unlock(&walk.mtx);
+}
+
+/* handle the entry name in dirfd, whose path is path. type is the d_type
+   reported by getdents, if it's DT_UNKNOWN or the size is needed, the
+   entry is stat'ed. symlinks are not followed, except for the roots,
+   which are passed with dirfd AT_FDCWD. */
+static void walk_entry(int dirfd, const char *name, const char *path, size_t len, int type) {
+	struct stat st;
+	bool have_st = 0;
+	const char *sname = dirfd == AT_FDCWD ? path : name;
+	int statflags = dirfd == AT_FDCWD ? 0 : AT_SYMLINK_NOFOLLOW;
+	if(type == DT_UNKNOWN) {
+		if(fstatat(dirfd, sname, &st, statflags) == -1) {
+			walk_error(path);
+			return;
+		}
+		have_st = 1;
+		type = IFTODT(st.st_mode);
+	}
+	if(type == DT_DIR) walk_push_dir(dirfd, name, path);
+	if(prog_state.walk_type && type != prog_state.walk_type) return;
+	if(prog_state.walk_name && fnmatch(prog_state.walk_name, name, 0)) return;
+	if(prog_state.cost_mode == COST_SIZE && !have_st &&
+	   fstatat(dirfd, sname, &st, statflags) == -1) {
+		walk_error(path);
+		return;
+	}
+	walk_emit(path, len, prog_state.cost_mode == COST_SIZE ? (double) st.st_size : 0);
+}
+
+static void walk_dir(walk_dir_item *it) {
+	char buf[64*1024], *path;
+	const char *dir = it->path;
+	size_t dlen = strlen(dir);
+	long n = 0, off;
+	int fd = it->fd != -1 ? it->fd : open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if(fd == -1) {
+		walk_error(dir);
+		return;
+	}
+	/* room for the longest name, so there's no limit on the depth */
+	if(!(path = malloc(dlen + 1 + NAME_MAX + 1))) die("out of memory\n");
+	memcpy(path, dir, dlen);
+	if(dlen && path[dlen - 1] != '/') path[dlen++] = '/';
+	while(!walk.stop && (n = syscall(SYS_getdents64, fd, buf, sizeof buf)) > 0) {
+		for(off = 0; off < n; ) {
+			struct walk_dirent *d = (void*)(buf + off);
+			size_t nlen = strlen(d->d_name);
+			off += d->d_reclen;
+			if(d->d_name[0] == '.' && (!d->d_name[1] || (d->d_name[1] == '.' && !d->d_name[2])))
+				continue;
+			memcpy(path + dlen, d->d_name, nlen + 1);
+			walk_entry(fd, d->d_name, path, dlen + nlen, d->d_type);
+		}
+	}
+	if(n == -1) walk_error(dir);
+	close(fd);
+	free(path);
+	walk_flush();
+}
+
+static void* walk_thread(void *arg) {
+	(void) arg;
+	pthread_mutex_lock(&walk.mtx);
+	while(1) {
+		while(sblist_empty(walk.dirs) && walk.busy && !walk.stop)
+			pthread_cond_wait(&walk.dirs_cond, &walk.mtx);
+		if(walk.stop || sblist_empty(walk.dirs)) break;
+		walk_dir_item dir = walk_pop_dir();
+		walk.busy++;
+		pthread_mutex_unlock(&walk.mtx);
+		walk_dir(&dir);
+		free(dir.path);
+		pthread_mutex_lock(&walk.mtx);
+		/* the last busy thread found no more work, wake up the others */
+		if(!--walk.busy && sblist_empty(walk.dirs))
+			pthread_cond_broadcast(&walk.dirs_cond);
+	}
+	pthread_mutex_unlock(&walk.mtx);
+	pthread_mutex_lock(&walk.qmtx);
+	if(!--walk.running) pthread_cond_signal(&walk.not_empty);
+	pthread_mutex_unlock(&walk.qmtx);
+	return 0;
+}
+
+static int walk_input(char** argv) {
+	size_t i;
+	char **root;
+	pending_line batch[WALK_BATCH];
+	size_t n = 0, next = 0;
+	int ret = 1;
+
+	walk.qsize = 4096;
+	walk.queue = malloc(walk.qsize * sizeof(pending_line));
+	walk.threads = malloc(prog_state.walk_threads * sizeof(pthread_t));
+	walk.dirs = sblist_new(sizeof(walk_dir_item), 256);
+	if(!walk.queue || !walk.threads || !walk.dirs) die("out of memory\n");
+
+	if(sblist_getsize(prog_state.walk) > walk.qsize) die("too many -walk roots\n");
+	/* the roots are tested like every other entry */
+	sblist_iter(prog_state.walk, root) {
+		char *name = strrchr(*root, '/');
+		walk_entry(AT_FDCWD, name && name[1] ? name + 1 : *root, *root, strlen(*root), DT_UNKNOWN);
+		walk_flush();
+	}
+
+	walk.running = prog_state.walk_threads;
+	for(i = 0; i < prog_state.walk_threads; i++)
+		if((errno = pthread_create(&walk.threads[i], 0, walk_thread, 0))) {
+			perror("pthread_create");
+			die("could not start walker threads\n");
+		}
+
+	while(1) {
+		if(next == n) {
+			pthread_mutex_lock(&walk.qmtx);
+			while(!walk.qcount && walk.running) {
+				if(coalesce.since) {
+					pthread_mutex_unlock(&walk.qmtx);
+					stage_flush_all();
+					pthread_mutex_lock(&walk.qmtx);
+					continue;
+				}
+				walk.consumer_waiting = 1;
+				pthread_cond_wait(&walk.not_empty, &walk.qmtx);
+				walk.consumer_waiting = 0;
+			}
+			for(n = next = 0; n < WALK_BATCH && walk.qcount; n++, walk.qcount--) {
+				batch[n] = walk.queue[walk.qhead];
+				walk.qhead = (walk.qhead + 1) % walk.qsize;
+			}
+			if(walk.producers_waiting) pthread_cond_broadcast(&walk.not_full);
+			pthread_mutex_unlock(&walk.qmtx);
+			if(!n) break;
+		}
+		prog_state.cost_hint = batch[next].cost;
+		ret = dispatch_line(batch[next].line, batch[next].len, argv);
+		free(batch[next++].line);
+		/* a failed job, or -count reached */
+		if(ret != 1) break;
+	}
+	while(next < n) free(batch[next++].line);
+
+	pthread_mutex_lock(&walk.mtx);
+	pthread_mutex_lock(&walk.qmtx);
+	walk.stop = 1;
+	pthread_cond_broadcast(&walk.dirs_cond);
+	pthread_cond_broadcast(&walk.not_full);
+	pthread_mutex_unlock(&walk.qmtx);
+	pthread_mutex_unlock(&walk.mtx);
+	for(i = 0; i < prog_state.walk_threads; i++)
+		pthread_join(walk.threads[i], 0);
+
+	for(; walk.qcount; walk.qcount--, walk.qhead = (walk.qhead + 1) % walk.qsize)
+		free(walk.queue[walk.qhead].line);
+	while(!sblist_empty(walk.dirs)) {
+		walk_dir_item it = walk_pop_dir();
+		if(it.fd != -1) close(it.fd);
+		free(it.path);
+	}
+	sblist_free(walk.dirs);
+	free(walk.queue);
+	free(walk.threads);
+	return ret != 0;
+}
+
+/* -stream: several inputs, each with a weight and optionally its own
+   command, sharing the slots. a reader thread per stream fills a small
+   queue of lines, and free slots are handed out by deficit round robin:
+   every job costs one, the stream being served keeps getting slots until
+   its deficit is used up, then the next stream with pending lines gets
+   its weight added. a stream without pending lines loses its deficit, so
+   idle capacity goes to the other streams instead of being saved up. */
+#define STREAM_QSIZE 256
+typedef struct {
+	char *name, *path, *statefile;
+	char temp_state[256];
+	char **argv; /* command template, or NULL for the one after -exec */
+	unsigned long weight, deficit, skip;
+	FILE *f;
+	pthread_t thread;
+	pending_line queue[STREAM_QSIZE];
+	size_t qhead, qcount;
+	unsigned long long lines, started, failed;
+	bool eof, stopped, error;
+} input_stream;
+
+static struct {
+	input_stream *list;
+	size_t n, cur;
+	pthread_mutex_t mtx;
+	pthread_cond_t not_full;
+} streams = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+	.not_full = PTHREAD_COND_INITIALIZER,
+};
+
+/* parse name=X,path=FILE,weight=N,statefile=FILE,exec=CMD ARGS...
+   exec takes the rest of the spec, its arguments are separated by blanks. */
+static void parse_streams(bool resume) {
+	char **spec;
+	size_t i;
+	streams.n = sblist_getsize(prog_state.stream_specs);
+	if(!(streams.list = calloc(streams.n, sizeof(input_stream)))) die("out of memory\n");
+	i = 0;
+	sblist_iter(prog_state.stream_specs, spec) {
+		input_stream *st = &streams.list[i++];
+		char *p = *spec;
+		st->weight = 1;
+		while(*p) {
+			char *v = strchr(p, '='), *e;
+			if(!v) die("-stream: expected key=value at %s\n", p);
+			*v++ = 0;
+			if(!strcmp(p, "exec")) {
+				size_t argc = 0, max = strlen(v) / 2 + 2;
+				if(!(st->argv = calloc(max, sizeof(char*)))) die("out of memory\n");
+				for(p = strtok(v, " \t"); p; p = strtok(0, " \t"))
+					st->argv[argc++] = p;
+				if(!argc) die("-stream: exec without arguments\n");
+				break;
+			}
+			if((e = strchr(v, ','))) *e++ = 0;
+			else e = v + strlen(v);
+			if(!strcmp(p, "name")) st->name = v;
+			else if(!strcmp(p, "path")) st->path = v;
+			else if(!strcmp(p, "statefile")) st->statefile = v;
+			else if(!strcmp(p, "weight") && isdigit(*v)) st->weight = atol(v);
+			else die("-stream: unknown key or invalid value %s=%s\n", p, v);
+			p = e;
+		}
+		if(!st->path) die("-stream needs path=FILE\n");
+		if(!st->name) st->name = st->path;
+		if(!st->weight) die("-stream: weight must be >= 1\n");
+		if(!st->argv && !prog_state.cmd_startarg)
+			die("-stream %s: no exec= and no -exec\n", st->name);
+		if(st->statefile) {
+			snprintf(st->temp_state, sizeof st->temp_state, "%s.%u", st->statefile, (unsigned) getpid());
+			if(resume) st->skip = read_statefile(st->statefile);
+		} else if(resume)
+			die("-resume needs statefile= for every -stream\n");
+	}
+}
+
+static void stream_wake(void) {
+	if(write(sigchld_pipe[1], "", 1) == -1) {}
+}
+
+/* read a record including its separator, like getdelim */
+static ssize_t stream_getrec(char **rec, size_t *cap, FILE *f) {
+	size_t rl = prog_state.rs_len, len = 0, pcap = 0;
+	char *part = 0;
+	ssize_t n;
+	if(rl == 1) return getdelim(rec, cap, prog_state.rs[0], f);
+	while((n = getdelim(&part, &pcap, prog_state.rs[rl - 1], f)) > 0) {
+		if(len + n + 1 > *cap) {
+			char *p = realloc(*rec, len + n + 1);
+			if(!p) die("out of memory\n");
+			*rec = p;
+			*cap = len + n + 1;
+		}
+		memcpy(*rec + len, part, n + 1);
+		len += n;
+		if(len >= rl && !memcmp(*rec + len - rl, prog_state.rs, rl)) break;
+	}
+	free(part);
+	return len ? (ssize_t) len : -1;
+}
+
+static void* stream_reader(void *arg) {
+	input_stream *st = arg;
+	char *line = 0;
+	size_t cap = 0;
+	ssize_t n;
+	unsigned long long lineno = 0;
+
+	while((n = stream_getrec(&line, &cap, st->f)) > 0) {
+		size_t len = n;
+		if(++lineno <= st->skip) continue;
+		len = rec_len(line, len);
+		line[len] = 0;
+		pending_line pl = {.lineno = lineno, .len = len};
+		if(!(pl.line = malloc(len + 1))) die("out of memory\n");
+		memcpy(pl.line, line, len + 1);
+		pthread_mutex_lock(&streams.mtx);
+		while(st->qcount == STREAM_QSIZE && !st->stopped)
+			pthread_cond_wait(&streams.not_full, &streams.mtx);
+		if(st->stopped) {
+			pthread_mutex_unlock(&streams.mtx);
+			free(pl.line);
+			break;
+		}
+		st->queue[(st->qhead + st->qcount++) % STREAM_QSIZE] = pl;
+		st->lines++;
+		bool wake = st->qcount == 1;
+		pthread_mutex_unlock(&streams.mtx);
+		if(wake) stream_wake();
+	}
+	pthread_mutex_lock(&streams.mtx);
+	if(ferror(st->f)) {
+		dprintf(2, "%s: read error\n", st->path);
+		st->error = 1;
+	}
+	st->eof = 1;
+	pthread_mutex_unlock(&streams.mtx);
+	stream_wake();
+	free(line);
+	return 0;
+}
+
+/* a failed job stops its stream, like it stops the input in exec mode */
+static void stream_failed(size_t stream) {
+	input_stream *st = &streams.list[stream];
+	pthread_mutex_lock(&streams.mtx);
+	st->failed++;
+	st->stopped = 1;
+	pthread_cond_broadcast(&streams.not_full);
+	pthread_mutex_unlock(&streams.mtx);
+}
+
+static int stream_ready(input_stream *st) {
+	return st->qcount && !st->stopped;
+}
+
+/* pick the stream to start the next job for and take its line into pl.
+   returns NULL if no stream has a line pending. */
+static input_stream* stream_pick(pending_line *pl) {
+	size_t tries;
+	for(tries = 0; tries <= streams.n; tries++) {
+		input_stream *st = &streams.list[streams.cur];
+		if(!stream_ready(st)) st->deficit = 0;
+		else if(st->deficit) {
+			st->deficit--;
+			*pl = st->queue[st->qhead];
+			st->qhead = (st->qhead + 1) % STREAM_QSIZE;
+			if(st->qcount-- == STREAM_QSIZE)
+				pthread_cond_broadcast(&streams.not_full);
+			return st;
+		}
+		streams.cur = (streams.cur + 1) % streams.n;
+		st = &streams.list[streams.cur];
+		if(stream_ready(st)) st->deficit += st->weight;
+	}
+	return 0;
+}
+
+static int streams_done(void) {
+	size_t i;
+	for(i = 0; i < streams.n; i++)
+		if(!streams.list[i].stopped && (!streams.list[i].eof || streams.list[i].qcount))
+			return 0;
+	return 1;
+}
+
+/* expand the placeholders of the command template tmpl for line, and
+   launch it in a free slot. returns the slot, or -1 if the line is too
+   long for substitution. */
+static long launch_template(char **tmpl, char *line, size_t len, unsigned long long lineno) {
+	char subst_buf[MAX_SUBSTS][4096], *argv[4096];
+	size_t i, nsubst = 0, slot;
+	fields_reset();
+	for(i = 0; tmpl[i] && i + 1 < ARRAY_SIZE(argv); i++) {
+		argv[i] = tmpl[i];
+		if(nsubst < MAX_SUBSTS && strchr(tmpl[i], '{')) {
+			int r = subst_arg(subst_buf[nsubst], 4096, tmpl[i], line, len, lineno);
+			if(r == -1) {
+				dprintf(2, "fatal: line too long for substitution: %s\n", line);
+				return -1;
+			}
+			if(r) argv[i] = subst_buf[nsubst++];
+		}
+	}
+	argv[i] = NULL;
+	prog_state.launch_lineno = lineno;
+	slot = find_free_slot();
+	launch_job(slot, argv);
+	return slot;
+}
+
+static void stream_launch(input_stream *st, pending_line *pl) {
+	long slot = launch_template(st->argv ? st->argv : prog_state.cmd_argv, pl->line, pl->len, pl->lineno);
+	if(slot == -1) {
+		stream_failed(st - streams.list);
+		return;
+	}
+	prog_state.lineno++;
+	((job_info*) sblist_get(prog_state.job_infos, slot))->stream = st - streams.list;
+	st->started++;
+	if(st->statefile)
+		write_statefile(pl->lineno, st->temp_state, st->statefile);
+}
+
+static int stream_input(void) {
+	size_t i;
+	int ret = 1;
+	pending_line pl;
+
+	for(i = 0; i < streams.n; i++) {
+		input_stream *st = &streams.list[i];
+		if(!(st->f = fopen(st->path, "re"))) {
+			perror(st->path);
+			die("could not open stream %s\n", st->name);
+		}
+		if((errno = pthread_create(&st->thread, 0, stream_reader, st))) {
+			perror("pthread_create");
+			die("could not start stream reader\n");
+		}
+	}
+	while(1) {
+		if(free_slots()) {
+			pthread_mutex_lock(&streams.mtx);
+			input_stream *st = stream_pick(&pl);
+			int done = !st && streams_done();
+			pthread_mutex_unlock(&streams.mtx);
+			if(st) {
+				stream_launch(st, &pl);
+				free(pl.line);
+			} else if(done)
+				break;
+			else
+				/* woken up by the readers through the self-pipe */
+				wait_event(-1, -1);
+		} else {
+			int retval;
+			reap_child(&retval);
+		}
+	}
+	for(i = 0; i < streams.n; i++) {
+		input_stream *st = &streams.list[i];
+		/* a stopped stream's reader may be blocked reading */
+		if(st->stopped && !st->eof) pthread_detach(st->thread);
+		else {
+			pthread_join(st->thread, 0);
+			fclose(st->f);
+		}
+		for(; st->qcount; st->qcount--, st->qhead = (st->qhead + 1) % STREAM_QSIZE)
+			free(st->queue[st->qhead].line);
+		if(st->error || st->failed) ret = 0;
+	}
+	return ret;
+}
+
+/* -dag: every input line is a record "ID DEPS PAYLOAD", where DEPS is a
+   comma separated list of the IDs which have to succeed before the job for
+   PAYLOAD can start, or - for none. fields are separated like for -delim.
+   the whole input is read first, as records may depend on ones further
+   down. a job is started as soon as its last dependency succeeded, and
+   when a job fails, everything depending on it is skipped.
+   nodes live in one flat array, found by id through an open addressing
+   table, and the edges from a node to its dependents are stored in
+   compressed sparse row form, so a node costs less than 100 bytes. */
+enum dag_state { DAG_WAIT = 0, DAG_RUNNING, DAG_DONE, DAG_FAILED, DAG_SKIPPED };
+typedef struct {
+	size_t off; /* of the id in dag.text, the other offsets are relative to it */
+	uint32_t id_len, deps_off, deps_len, payload_off, payload_len;
+	uint32_t pending; /* dependencies which didn't succeed yet */
+	unsigned char state;
+} dag_node;
+
+static struct {
+	char *text;
+	size_t textlen;
+	dag_node *nodes;
+	uint32_t n;
+	uint32_t *table; /* node index + 1, or 0 */
+	size_t tmask;
+	/* the dependents of node i are children[child_start[i]] up to
+	   children[child_start[i+1]] */
+	uint32_t *child_start, *children;
+	uint32_t *queue, *stack; /* ready nodes, nodes to skip */
+	size_t qhead, qtail;
+	int log_fd;
+	unsigned long long done, failed, skipped;
+} dag = {.log_fd = -1};
+
+static uint32_t* dag_slot(const char *id, size_t len) {
+	size_t h = hash64(id, len) & dag.tmask;
+	while(dag.table[h]) {
+		dag_node *nd = &dag.nodes[dag.table[h] - 1];
+		if(nd->id_len == len && !memcmp(dag.text + nd->off, id, len)) break;
+		h = (h + 1) & dag.tmask;
+	}
+	return &dag.table[h];
+}
+
+static void dag_read(int fd) {
+	size_t cap = 1024*1024;
+	ssize_t n;
+	if(!(dag.text = malloc(cap))) die("out of memory\n");
+	while(1) {
+		if(cap - dag.textlen < 64*1024) {
+			char *p = realloc(dag.text, cap *= 2);
+			if(!p) die("out of memory\n");
+			dag.text = p;
+		}
+		n = read(fd, dag.text + dag.textlen, cap - dag.textlen - 1);
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			perror("read");
+			die("could not read input\n");
+		}
+		if(!n) break;
+		dag.textlen += n;
+	}
+	dag.text[dag.textlen] = 0;
+}
+
+/* count (fill == 0) or store the edges of all nodes */
+static void dag_link(int fill, uint32_t *cursor) {
+	uint32_t i;
+	for(i = 0; i < dag.n; i++) {
+		dag_node *nd = &dag.nodes[i];
+		char *d = dag.text + nd->off + nd->deps_off, *e = d + nd->deps_len, *c;
+		if(nd->deps_len == 1 && *d == '-') continue;
+		for(; d < e; d = c + 1) {
+			if(!(c = memchr(d, ',', e - d))) c = e;
+			if(c == d) continue;
+			uint32_t dep = *dag_slot(d, c - d);
+			if(!dep) die("unknown dependency %.*s of %.*s\n", (int)(c - d), d,
+				     (int) nd->id_len, dag.text + nd->off);
+			if(fill) dag.children[cursor[dep - 1]++] = i;
+			else {
+				dag.child_start[dep]++;
+				nd->pending++;
+			}
+		}
+	}
+}
+
+static void dag_build(void) {
+	char *p = dag.text, *e = dag.text + dag.textlen, *nl;
+	size_t lines = count_records(p, dag.textlen) + 1, tsize = 16;
+	uint32_t i, *cursor;
+
+	if(lines >= UINT32_MAX) die("too many records\n");
+	while(tsize < lines * 2) tsize *= 2;
+	dag.tmask = tsize - 1;
+	dag.nodes = malloc(lines * sizeof(dag_node));
+	dag.table = calloc(tsize, sizeof(uint32_t));
+	if(!dag.nodes || !dag.table) die("out of memory\n");
+
+	for(; p < e; p = nl) {
+		char *id, *deps, *payload;
+		size_t len, idlen, dlen;
+		if(!(nl = rec_next(p, e - p))) nl = e;
+		len = rec_len(p, nl - p);
+		p[len] = 0;
+		if(!(id = get_field(p, len, 1, &idlen)) || !idlen) continue;
+		if(!(deps = get_field(p, len, 2, &dlen)))
+			die("record %.*s has no dependency field\n", (int) idlen, id);
+		payload = deps + dlen;
+		if(prog_state.delim) {
+			if(payload < p + len) payload++;
+		} else while(payload < p + len && isblank(*payload)) payload++;
+		uint32_t *slot = dag_slot(id, idlen);
+		if(*slot) die("duplicate id %.*s\n", (int) idlen, id);
+		dag.nodes[dag.n] = (dag_node) {
+			.off = id - dag.text, .id_len = idlen,
+			.deps_off = deps - id, .deps_len = dlen,
+			.payload_off = payload - id, .payload_len = (p + len) - payload,
+		};
+		*slot = ++dag.n;
+	}
+
+	dag.child_start = calloc(dag.n + 1, sizeof(uint32_t));
+	if(!dag.child_start) die("out of memory\n");
+	dag_link(0, 0);
+	for(i = 0; i < dag.n; i++) dag.child_start[i + 1] += dag.child_start[i];
+	dag.children = malloc((dag.child_start[dag.n] + 1) * sizeof(uint32_t));
+	cursor = malloc((dag.n + 1) * sizeof(uint32_t));
+	dag.queue = malloc((dag.n + 1) * sizeof(uint32_t));
+	if(!dag.children || !cursor || !dag.queue) die("out of memory\n");
+	memcpy(cursor, dag.child_start, dag.n * sizeof(uint32_t));
+	dag_link(1, cursor);
+	free(cursor);
+}
+
+static void dag_release(uint32_t i) {
+	uint32_t c;
+	for(c = dag.child_start[i]; c < dag.child_start[i + 1]; c++) {
+		dag_node *child = &dag.nodes[dag.children[c]];
+		if(!--child->pending && child->state == DAG_WAIT)
+			dag.queue[dag.qtail++] = dag.children[c];
+	}
+}
+
+static void dag_skip(uint32_t i) {
+	size_t sp = 0;
+	uint32_t c;
+	if(!dag.stack && !(dag.stack = malloc((dag.n + 1) * sizeof(uint32_t))))
+		die("out of memory\n");
+	dag.stack[sp++] = i;
+	while(sp) {
+		i = dag.stack[--sp];
+		for(c = dag.child_start[i]; c < dag.child_start[i + 1]; c++) {
+			dag_node *child = &dag.nodes[dag.children[c]];
+			if(child->state != DAG_WAIT) continue;
+			child->state = DAG_SKIPPED;
+			dag.skipped++;
+			dag.stack[sp++] = dag.children[c];
+		}
+	}
+}
+
+static void dag_finish(uint32_t i, int ok) {
+	dag_node *nd = &dag.nodes[i];
+	if(!ok) {
+		nd->state = DAG_FAILED;
+		dag.failed++;
+		dag_skip(i);
+		return;
+	}
+	nd->state = DAG_DONE;
+	dag.done++;
+	if(dag.log_fd != -1) dprintf(dag.log_fd, "%.*s\n", (int) nd->id_len, dag.text + nd->off);
+	dag_release(i);
+}
+
+/* -resume: the statefile is a log of the ids of the succeeded jobs */
+static void dag_resume(void) {
+	FILE *f = fopen(prog_state.statefile, "r");
+	char *line = 0;
+	size_t cap = 0;
+	ssize_t n;
+	uint32_t i;
+	if(!f) return;
+	while((n = getline(&line, &cap, f)) > 0) {
+		size_t len = n;
+		chomp(line, &len);
+		uint32_t node = *dag_slot(line, len);
+		if(node && dag.nodes[node - 1].state != DAG_DONE) {
+			dag.nodes[node - 1].state = DAG_DONE;
+			dag.done++;
+		}
+	}
+	free(line);
+	fclose(f);
+	for(i = 0; i < dag.n; i++)
+		if(dag.nodes[i].state == DAG_DONE) dag_release(i);
+}
+
+static int dag_input(void) {
+	uint32_t i;
+	int retval;
+
+	dag_read(0);
+	dag_build();
+	if(prog_state.dag_resume) dag_resume();
+	if(prog_state.statefile) {
+		dag.log_fd = open(prog_state.statefile, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC |
+				  (prog_state.dag_resume ? 0 : O_TRUNC), S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if(dag.log_fd == -1) {
+			perror("open");
+			die("could not open statefile\n");
+		}
+	}
+	for(i = 0; i < dag.n; i++)
+		if(dag.nodes[i].state == DAG_WAIT && !dag.nodes[i].pending)
+			dag.queue[dag.qtail++] = i;
+
+	while(1) {
+		if(dag.qhead < dag.qtail && free_slots()) {
+			i = dag.queue[dag.qhead++];
+			dag_node *nd = &dag.nodes[i];
+			long slot = launch_template(prog_state.cmd_argv, dag.text + nd->off + nd->payload_off,
+						    nd->payload_len, i + 1ULL);
+			prog_state.lineno++;
+			if(slot == -1 || ((job_info*) sblist_get(prog_state.job_infos, slot))->pid == -1)
+				dag_finish(i, 0);
+			else
+				nd->state = DAG_RUNNING;
+			continue;
+		}
+		if(!prog_state.threads_running) break;
+		job_info *job = sblist_get(prog_state.job_infos, reap_child(&retval));
+		dag_finish(job->lineno - 1, !process_failed(retval));
+	}
+	if(dag.log_fd != -1) close(dag.log_fd);
+
+	unsigned long long blocked = dag.n - dag.done - dag.failed - dag.skipped;
+	if(blocked)
+		dprintf(2, "error: %llu jobs not run because of a dependency cycle\n", blocked);
+	return !dag.failed && !dag.skipped && !blocked;
+}
+
+static void print_stats(void) {
+	size_t i, n = sblist_getsize(prog_state.job_infos);
+	unsigned long long lines = 0, bytes = 0, max_lines = 0, max_bytes = 0;
+
+	dprintf(2, "stats: %llu lines read, %llu jobs started, %llu failed\n",
+		prog_state.lineno, prog_state.jobs_started, prog_state.jobs_failed);
+	if(prog_state.dedup)
+		dprintf(2, "stats: %llu duplicate lines dropped\n", prog_state.dedup_dropped);
+	if(prog_state.cache)
+		dprintf(2, "stats: cache: %llu hits, %llu misses, %llu stored\n",
+			cache.hits, cache.misses, cache.stored);
+	if(prog_state.dag)
+		dprintf(2, "stats: dag: %u jobs, %llu succeeded, %llu failed, %llu skipped\n",
+			dag.n, dag.done, dag.failed, dag.skipped);
+	if(prog_state.coalesce)
+		dprintf(2, "stats: coalesce: %llu writes\n", coalesce.writes);
+	if(prog_state.rate)
+		dprintf(2, "stats: rate: %.2f launches/s, limit %g, burst %lu\n",
+			bucket_rate(&launch_bucket), prog_state.rate, prog_state.burst);
+	if(prog_state.bwlimit)
+		dprintf(2, "stats: bwlimit: %.0f bytes/s, limit %lu\n",
+			bucket_rate(&byte_bucket), prog_state.bwlimit);
+	if(prog_state.uring && uring.fd == -1)
+		dprintf(2, "stats: io_uring not available\n");
+	else if(prog_state.uring)
+		dprintf(2, "stats: io_uring: %llu ops in %llu submissions\n", uring.ops, uring.enters);
+	for(i = 0; i < streams.n; i++)
+		dprintf(2, "stats: stream %s: %llu lines, %llu jobs started, %llu failed\n",
+			streams.list[i].name, streams.list[i].lines,
+			streams.list[i].started, streams.list[i].failed);
+	if(!prog_state.pipe_mode || !n) return;
+	for(i = 0; i < n; i++) {
+		job_info *job = sblist_get(prog_state.job_infos, i);
+		lines += job->lines_in;
+		bytes += job->bytes_in;
+		if(job->lines_in > max_lines) max_lines = job->lines_in;
+		if(job->bytes_in > max_bytes) max_bytes = job->bytes_in;
+	}
+	for(i = 0; i < n; i++) {
+		job_info *job = sblist_get(prog_state.job_infos, i);
+		dprintf(2, "stats: worker %zu: %llu lines, %llu bytes\n",
+			i, job->lines_in, job->bytes_in);
+	}
+	/* skew is the ratio of the busiest worker to a perfectly even split */
+	if(lines && bytes)
+		dprintf(2, "stats: skew lines %.2f, bytes %.2f\n",
+			(double) max_lines * n / lines, (double) max_bytes * n / bytes);
+}
+
+int main(int argc, char** argv) {
+	unsigned i;
+
+	char tempdir_buf[256];
+
+	srand(time(NULL));
+
+	if(argc > 4096) argc = 4096;
+
+	prog_state.threads_running = 0;
+
+	if(parse_args(argc, argv)) return 1;
+
+	if(prog_state.statefile)
+		snprintf(prog_state.temp_state, sizeof(prog_state.temp_state), "%s.%u", prog_state.statefile, (unsigned) getpid());
+
+	prog_state.tempdir = NULL;
+
+	if(prog_state.buffered) {
+		prog_state.tempdir = tempdir_buf;
+		if(mktempdir("jobflow", tempdir_buf, sizeof(tempdir_buf)) == 0) {
+			perror("mkdtemp");
+			die("could not create tempdir\n");
+		}
+	} else {
+		/* if the stdout/stderr fds are not in O_APPEND mode,
+		   the dup()'s of the fds in posix_spawn can cause different
+		   file positions, causing the different processes to overwrite each others output.
+		   testcase:
+		   seq 100 | ./jobflow.out -threads=100 -exec echo {} > test.tmp ; wc -l test.tmp
+		*/
+		if(fcntl(1, F_SETFL, O_APPEND) == -1) perror("fcntl");
+		if(fcntl(2, F_SETFL, O_APPEND) == -1) perror("fcntl");
+	}
+
+	if(prog_state.cmd_startarg) {
+		for(i = prog_state.cmd_startarg; i < (unsigned) argc; i++) {
+			prog_state.cmd_argv[i - prog_state.cmd_startarg] = argv[i];
+		}
+		prog_state.cmd_argv[argc - prog_state.cmd_startarg] = NULL;
+	}
+
+	prog_state.job_infos = sblist_new(sizeof(job_info), prog_state.numthreads);
+	init_queue();
+
+	if(need_event_loop())
+		setup_event_loop();
+
+	if(prog_state.trace)
+		trace_init();
+
+	if(prog_state.cache)
+		cache_open();
+
+	if(prog_state.dedup)
+		dedup_init();
+
+	if(prog_state.uring)
+		uring_init();
+
+	if(prog_state.spawners)
+		spawners_start();
+
+	if(prog_state.plugin)
+		plugin_load(argc, argv);
+
+	prog_state.lineno = 0;
+	seek_skip(0);
+
+	int exitcode = 1;
+
+	if(prog_state.dag) {
+		if(dag_input()) exitcode = 0;
+	} else if(prog_state.stream_specs) {
+		if(stream_input()) exitcode = 0;
+	} else if(prog_state.walk) {
+		if(walk_input(argv)) exitcode = 0;
+	} else if(prog_state.readahead ? readahead_input(argv) : split_input(0, dispatch_line, argv))
+		exitcode = 0;
+
+	if(!exitcode && prog_state.window && !flush_window(argv))
+		exitcode = 1;
 
 	if(prog_state.pipe_mode) {
 		close_pipes();
 	}
+	prog_state.input_done = 1;
 
 	if(prog_state.delayedflush)
-		write_statefile(prog_state.lineno - 1, prog_state.temp_state);
+		write_statefile(prog_state.lineno - 1, prog_state.temp_state, prog_state.statefile);
+
+	if(prog_state.plugin && plugin_finish())
+		exitcode = 1;
 
 	int retval = 0;
 	while(prog_state.threads_running) {
@@ -937,9 +5063,66 @@ int main(int argc, char** argv) {
 		if(!exitcode) exitcode = process_failed(retval);
 	}
 
+	if(prog_state.spawners)
+		spawners_stop();
+
+	/* run the failed and the lines not launched again on -resume, which
+	   skips as many lines as the statefile holds. write_statefile() adds
+	   one, which wraps around to 0 if line 1 is to be run again. */
+	if(prog_state.halted && prog_state.statefile) {
+		unsigned long long n = launched_lineno() + 1;
+		if(prog_state.halt_lineno && prog_state.halt_lineno < n)
+			n = prog_state.halt_lineno;
+		write_statefile(n - 2, prog_state.temp_state, prog_state.statefile);
+	}
+
+	while(outputs_open())
+		wait_event(-1, -1);
+	if(prog_state.merge && merge_waiting)
+		dprintf(2, "error: merge finished with incomplete streams\n");
+	if(walk.errors)
+		exitcode = 1;
+
+	if(prog_state.stats)
+		print_stats();
+
+	if(prog_state.trace)
+		trace_write();
+
 	if(prog_state.subst_entries) sblist_free(prog_state.subst_entries);
-	if(prog_state.job_infos) sblist_free(prog_state.job_infos);
+	if(prog_state.job_infos) {
+		job_info *job;
+		sblist_iter(prog_state.job_infos, job) {
+			free(job->args);
+			free(job->stage);
+			free(job->spawn_argv);
+			fa_free(job);
+		}
+		sblist_free(prog_state.job_infos);
+	}
 	if(prog_state.limits) sblist_free(prog_state.limits);
+	if(prog_state.window) sblist_free(prog_state.window);
+	if(prog_state.walk) sblist_free(prog_state.walk);
+	free(dedup.set);
+	free(dedup.bits);
+	jobflow_fields_free(&fields);
+	if(prog_state.dag) {
+		free(dag.text);
+		free(dag.nodes);
+		free(dag.table);
+		free(dag.child_start);
+		free(dag.children);
+		free(dag.queue);
+		free(dag.stack);
+	}
+	if(prog_state.stream_specs) {
+		for(i = 0; i < streams.n; i++) free(streams.list[i].argv);
+		free(streams.list);
+		sblist_free(prog_state.stream_specs);
+	}
+	free(prog_state.pfds);
+	free(merge_heap);
+	uring_exit();
 
 	if(prog_state.tempdir)
 		rmdir(prog_state.tempdir);
@@ -0,0 +1,48 @@
+/*
+MIT License
+Copyright (C) 2012-2021 rofl0r
+*/
+
+#ifndef JOBFLOW_PLUGIN_H
+#define JOBFLOW_PLUGIN_H
+
+/* interface for shared objects loaded with jobflow -plugin.
+
+   instead of spawning a process per line, jobflow calls into the plugin
+   from -threads worker threads. every worker thread gets its own context,
+   so a plugin only needs to be thread-safe regarding global state.
+
+   build a plugin with e.g.: cc -shared -fPIC myplugin.c -o myplugin.so */
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JOBFLOW_PLUGIN_ABI 1
+
+/* called once per worker thread before the first record.
+   argc/argv are the arguments following -exec, if any.
+   store the thread's context in *ctx. return 0 on success. */
+int jobflow_init(void **ctx, int argc, char **argv);
+
+/* process one record (a line without its line break, nul-terminated).
+   lineno is the sequence number, as {#} in exec mode.
+   write the output to out, which has room for outsize bytes, and return the
+   number of bytes of output. if more than outsize bytes are needed, return
+   the required size without writing anything; the function is then called
+   again for the same record with a big enough buffer.
+   return -1 if processing the record failed. */
+ssize_t jobflow_process(void *ctx, const char *rec, size_t len,
+                        unsigned long long lineno, char *out, size_t outsize);
+
+/* called once per worker thread after the last record. optional. */
+void jobflow_fini(void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
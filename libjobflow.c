@@ -0,0 +1,208 @@
+/*
+MIT License
+Copyright (C) 2012-2021 rofl0r
+*/
+
+/* libjobflow, the placeholder substitution and statefile code of
+   jobflow, shared by the cli and other programs. see libjobflow.h */
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#undef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include "libjobflow.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* field placeholders: {N} is the Nth field of the line, {-N} the Nth from
+   the end, {N..M} the fields N to M including the separators between
+   them. the line is split once, when the first of them is expanded, into
+   a table of field offsets that the others reuse. */
+
+/* parse the placeholder at s, which starts the template tmpl or follows
+   something in it. return its length or 0 if it's none. */
+static size_t parse_field_ref(const char *tmpl, const char *s, int delim, long *first, long *last) {
+	char *e;
+	if(delim == JOBFLOW_NO_FIELDS || (s > tmpl && s[-1] == '$'))
+		return 0;
+	if(*s != '{' || !(isdigit(s[1]) || (s[1] == '-' && isdigit(s[2]))))
+		return 0;
+	*first = *last = strtol(s + 1, &e, 10);
+	if(e[0] == '.' && e[1] == '.') {
+		if(!(isdigit(e[2]) || (e[2] == '-' && isdigit(e[3])))) return 0;
+		*last = strtol(e + 2, &e, 10);
+	}
+	if(*e != '}' || !*first || !*last) return 0;
+	return e + 1 - s;
+}
+
+int jobflow_line_ref(const char *tmpl, int delim) {
+	const char *s = tmpl;
+	long a, b;
+	if(strstr(s, "{}") || strstr(s, "{.}")) return 1;
+	for(; (s = strchr(s, '{')); s++)
+		if(parse_field_ref(tmpl, s, delim, &a, &b)) return 1;
+	return 0;
+}
+
+static int field_add(jobflow_fields *f, size_t start, size_t end) {
+	if(f->n == f->cap) {
+		size_t cap = f->cap ? f->cap * 2 : 64;
+		uint32_t *pos = realloc(f->pos, cap * 2 * sizeof(uint32_t));
+		if(!pos) return -1;
+		f->pos = pos;
+		f->cap = cap;
+	}
+	f->pos[2*f->n] = start;
+	f->pos[2*f->n+1] = end;
+	f->n++;
+	return 0;
+}
+
+/* bitmask of the separators in the 16 bytes at p. for runs of blanks,
+   those are the spaces and tabs. */
+static inline unsigned sep_mask16(const char *p, int d) {
+#ifdef __SSE2__
+	__m128i v = _mm_loadu_si128((const __m128i*) p);
+	if(d) return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(d)));
+	return _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+	                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))));
+#else
+	unsigned i, m = 0;
+	for(i = 0; i < 16; i++)
+		if(d ? p[i] == d : isblank((unsigned char) p[i])) m |= 1U << i;
+	return m;
+#endif
+}
+
+/* split line into fields separated by d, or by runs of blanks if d is 0.
+   the separators are found 16 bytes at a time. with runs of blanks, a
+   field starts or ends wherever the mask changes between two bytes. */
+static int split_fields(jobflow_fields *f, const char *line, size_t len, int d) {
+	size_t i, start = 0;
+	int inblank = 1; /* leading blanks don't start a field */
+	f->n = 0;
+	for(i = 0; i < len; i += 16) {
+		unsigned m;
+		if(len - i >= 16) m = sep_mask16(line + i, d);
+		else {
+			char tail[16] = {0};
+			memcpy(tail, line + i, len - i);
+			m = sep_mask16(tail, d) & ((1U << (len - i)) - 1);
+		}
+		if(d) {
+			for(; m; m &= m - 1) {
+				size_t p = i + __builtin_ctz(m);
+				if(field_add(f, start, p)) return -1;
+				start = p + 1;
+			}
+			continue;
+		}
+		/* bits where the byte differs in blankness from the one before */
+		unsigned prev = (m << 1 | inblank) & 0xffff;
+		unsigned t = m ^ prev;
+		if(len - i < 16) t &= (1U << (len - i)) - 1;
+		for(; t; t &= t - 1) {
+			size_t p = i + __builtin_ctz(t);
+			if(inblank) start = p;
+			else if(field_add(f, start, p)) return -1;
+			inblank = !inblank;
+		}
+	}
+	if((d || !inblank) && field_add(f, start, len)) return -1;
+	f->valid = 1;
+	return 0;
+}
+
+/* the text of the fields first to last, as parsed by parse_field_ref() */
+static size_t field_range(jobflow_fields *f, const char *line, long first, long last, const char **what) {
+	long n = f->n;
+	if(first < 0) first += n + 1;
+	if(last < 0) last += n + 1;
+	if(first < 1) first = 1;
+	if(last > n) last = n;
+	*what = line;
+	if(first > last) return 0;
+	*what = line + f->pos[2*(first-1)];
+	return f->pos[2*(last-1)+1] - f->pos[2*(first-1)];
+}
+
+void jobflow_fields_free(jobflow_fields *f) {
+	free(f->pos);
+	memset(f, 0, sizeof *f);
+}
+
+int jobflow_subst(char *dest, size_t dest_size, const char *source,
+                  const char *line, size_t line_size, unsigned long long lineno,
+                  int delim, jobflow_fields *f) {
+	char *d = dest, *e = dest + dest_size, linenostr[32];
+	const char *what, *tmpl = source;
+	size_t what_size, n;
+	long first, last;
+	int ret = 0;
+	while(*source) {
+		if(*source != '{') {
+			if(d + 1 >= e) goto too_big;
+			*d++ = *source++;
+			continue;
+		}
+		if(source[1] == '}') {
+			what = line;
+			what_size = line_size;
+			source += 2;
+		} else if(source[1] == '.' && source[2] == '}') {
+			what = line;
+			what_size = line_size;
+			while(what_size && line[what_size-1] != '.') what_size--;
+			if(what_size) what_size--;
+			else what_size = line_size;
+			source += 3;
+		} else if(source[1] == '#' && source[2] == '}') {
+			what = linenostr;
+			what_size = sprintf(linenostr, "%llu", lineno);
+			source += 3;
+		} else if((n = parse_field_ref(tmpl, source, delim, &first, &last))) {
+			if(!f->valid && split_fields(f, line, line_size, delim)) {
+				errno = ENOMEM;
+				return -1;
+			}
+			what_size = field_range(f, line, first, last, &what);
+			source += n;
+		} else {
+			if(d + 1 >= e) goto too_big;
+			*d++ = *source++;
+			continue;
+		}
+		if((size_t)(e - d) <= what_size) goto too_big;
+		memcpy(d, what, what_size);
+		d += what_size;
+		ret++;
+	}
+	*d = 0;
+	return ret;
+	too_big:
+	errno = E2BIG;
+	return -1;
+}
+
+int jobflow_write_statefile(const char *tempfile, const char *statefile, unsigned long long n) {
+	int fd = open(tempfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if(fd == -1) return -1;
+	int r = dprintf(fd, "%llu\n", n);
+	if(close(fd) == -1 || r < 0) return -1;
+	return rename(tempfile, statefile);
+}
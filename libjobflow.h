@@ -0,0 +1,62 @@
+/*
+MIT License
+Copyright (C) 2012-2021 rofl0r
+*/
+
+#ifndef LIBJOBFLOW_H
+#define LIBJOBFLOW_H
+
+/* libjobflow: the part of jobflow that turns an input record into a
+   command line, and keeps the statefile, for C programs that build job
+   command lines the way jobflow -exec does.
+
+   the jobflow cli is linked against the same code: {}, {.}, {#} and the
+   -delim field placeholders are expanded by jobflow_subst(), and
+   -statefile is written with jobflow_write_statefile(). the scheduling,
+   spawning and reaping of jobs stays in the cli.
+
+   nothing here keeps global state, blocks, starts threads or touches
+   signals. a jobflow_fields table must only be used by one thread at a
+   time.
+
+   link with -ljobflow, the static or shared library built by make lib. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* offset table of the fields of a line, zero-initialize it, and set
+   valid to 0 when the line changes */
+typedef struct {
+	uint32_t *pos;
+	size_t n, cap;
+	int valid;
+} jobflow_fields;
+
+#define JOBFLOW_NO_FIELDS (-1)
+
+/* expand the {}, {.}, {#}, {N}, {-N} and {N..M} placeholders of tmpl for
+   line into dest, the field ones only if delim isn't JOBFLOW_NO_FIELDS.
+   a field placeholder right after a $ is left alone, so shell parameters
+   like ${1} keep working. returns the number of substitutions done, -1
+   if dest is too small. */
+int jobflow_subst(char *dest, size_t dest_size, const char *tmpl,
+                  const char *line, size_t len, unsigned long long lineno,
+                  int delim, jobflow_fields *f);
+
+/* whether tmpl passes (a part of) the line, delim as for jobflow_subst() */
+int jobflow_line_ref(const char *tmpl, int delim);
+
+/* write n into statefile atomically, via tempfile. returns 0 on success. */
+int jobflow_write_statefile(const char *tempfile, const char *statefile, unsigned long long n);
+
+void jobflow_fields_free(jobflow_fields *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,6 +3,8 @@ test -z "$JF" && JF=./jobflow
 TMP=/tmp/jobflow.test.$$
 gcc tests/stdin_printer.c -o tests/stdin_printer.out || { error compiling tests/stdin_printer.c ; exit 1 ; }
 gcc tests/cpuwaster.c -o tests/cpuwaster.out || { error compiling tests/cpuwaster.c ; exit 1 ; }
+gcc -shared -fPIC tests/plugin_echo.c -o tests/plugin_echo.so || { error compiling tests/plugin_echo.c ; exit 1 ; }
+gcc tests/lib_subst.c libjobflow.c -o tests/lib_subst.out || { error compiling tests/lib_subst.c ; exit 1 ; }
 tmp() {
 	echo $TMP.$testno
 }
@@ -193,3 +195,272 @@ test_equal $(tmp).1 $(tmp).2
 
 dotest "limit cpu 1sec"
 seq 1 | $JF -limits cpu=1 -exec tests/cpuwaster.out 2 && echo "test $testno failed."
+
+dotest "speculate straggler buffered"
+seq 20 > $(tmp).1
+START=$(date +%s)
+$JF -threads=4 -buffered -speculate=3 -exec sh -c 'test "$1" = 20 && mkdir "$2" 2>/dev/null && sleep 10; echo "$1"' sh {} $(tmp).4 < $(tmp).1 | sort -n > $(tmp).2
+rmdir $(tmp).4
+test $(($(date +%s) - START)) -lt 8 || echo "test $testno failed."
+test_equal $(tmp).1 $(tmp).2
+
+dotest "lookahead cost field"
+printf '2 b 5\n4 d 9\n3 c 3\n5 e 2\n1 a 1\n' > $(tmp).1
+printf 'a 1\nb 5\nc 3\nd 9\ne 2\n' | $JF -threads=1 -lookahead=3 -cost=field:2 -exec echo {#} {} > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+
+dotest "partition field disjoint keys 5x"
+seq 1000 | awk '{print "k" ($1 % 37), $1}' > $(tmp).3
+cut -d " " -f 1 < $(tmp).3 | sort -u > $(tmp).1
+$JF -threads=5 -partition=field:1 -exec sh -c 'cut -d " " -f 1 | sort -u' < $(tmp).3 | sort > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+
+dotest "merge sorted bulk 4x"
+seq 100000 > $(tmp).1
+sort -R < $(tmp).1 > $(tmp).3
+$JF -threads=4 -bulk=64K -merge -mergenumeric -exec sort -n < $(tmp).3 > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+
+dotest "merge key field 3x"
+seq 1000 | awk '{print "k" $1, ($1 * 7919) % 1000}' > $(tmp).3
+sort -k2,2n < $(tmp).3 | cut -d " " -f 2 > $(tmp).1
+$JF -threads=3 -merge -mergekey=2 -mergenumeric -exec sort -k2,2n < $(tmp).3 | cut -d " " -f 2 > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+
+dotest "plugin echo 4x"
+seq 100000 > $(tmp).1
+$JF -threads=4 -plugin tests/plugin_echo.so < $(tmp).1 | sort -n > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+
+dotest "plugin failure exitcode"
+printf 'a\nfail\nb\n' | $JF -plugin tests/plugin_echo.so -exec x > /dev/null && echo "test $testno failed."
+
+dotest "plugin init failure"
+seq 5000 | $JF -threads=2 -plugin tests/plugin_echo.so -exec initfail > $(tmp).2 2>/dev/null && echo "test $testno failed."
+test -s $(tmp).2 && echo "test $testno failed."
+
+dotest "readahead spill echo 3x"
+seq 10000 > $(tmp).1
+$JF -readahead=128K -spill=$(tmp).4 -threads=3 -exec echo {} < $(tmp).1 | sort -n > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+
+dotest "readahead drains input while busy"
+(seq 500 ; touch $(tmp).4) | $JF -readahead=128K -spill=$(tmp).3 -threads=2 -exec sh -c 'test -e "$1" || echo busy' sh $(tmp).4 {} > $(tmp).2
+test $(wc -l < $(tmp).2) -lt 100 || echo "test $testno failed."
+cleanup
+
+dotest "outfile template mkdir"
+printf 'a\nb\nc\n' > $(tmp).1
+$JF -threads=3 -outfile=$(tmp).4/{}/{#}.out -exec echo {} < $(tmp).1
+cat $(tmp).4/a/1.out $(tmp).4/b/2.out $(tmp).4/c/3.out > $(tmp).2
+rm -rf $(tmp).4
+test_equal $(tmp).1 $(tmp).2
+
+dotest "outfile errors"
+echo a | $JF -outfile=$(tmp).4/{} -exec cat 2>/dev/null && echo "test $testno failed."
+touch $(tmp).4
+echo a | $JF -outfile=$(tmp).4/{}/x -exec echo {} 2> $(tmp).2 && echo "test $testno failed."
+grep -q "too long" $(tmp).2 && echo "test $testno failed."
+rm -f $(tmp).4
+
+dotest "linebuffered no interleaving 50x"
+seq 300 > $(tmp).1
+$JF -threads=50 -linebuffered -exec sh -c 'printf "%s " $1; sleep 0.01; echo $1' sh {} < $(tmp).1 | awk '$1 == $2 {print $1}' | sort -n > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+
+dotest "seq 10000 pipe cat linebuffered 3x"
+seq 10000 > $(tmp).1
+$JF -threads=3 -linebuffered -exec cat < $(tmp).1 | sort -n > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+
+dotest "linebuffered line longer than the buffer"
+{ echo a; head -c 100000 /dev/zero | tr '\0' x; echo; echo done; } > $(tmp).1
+echo $(tmp).1 | $JF -linebuffered -exec cat {} > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+
+dotest "trace json"
+seq 20 | $JF -threads=3 -trace=$(tmp).4 -exec true {}
+test $(grep -c '"name":"job"' $(tmp).4) = 20 || echo "test $testno failed."
+grep -q '"name":"dispatcher"' $(tmp).4 || echo "test $testno failed."
+rm -f $(tmp).4
+
+dotest "walk name type"
+mkdir -p $(tmp).4/a/b $(tmp).4/c
+touch $(tmp).4/a/x.txt $(tmp).4/a/b/y.txt $(tmp).4/a/b/z.dat $(tmp).4/c/w.txt
+find $(tmp).4 -name '*.txt' -type f | sort > $(tmp).1
+$JF -walk $(tmp).4 -walkthreads 3 -name '*.txt' -type f -threads 2 -exec echo {} | sort > $(tmp).2
+rm -rf $(tmp).4
+test_equal $(tmp).1 $(tmp).2
+
+dotest "stream weights 4x"
+seq 200 > $(tmp).3
+seq 1000 1100 > $(tmp).4
+(sed 's/^/a /' $(tmp).3 ; sed 's/^/b /' $(tmp).4) | sort > $(tmp).1
+$JF -threads=4 -stream path=$(tmp).3,weight=3 -stream "path=$(tmp).4,exec=echo b {}" -exec echo a {} | sort > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+
+dotest "dag order and skip"
+printf 'a - 1\nb a 2\nc b,a 3\nd - fail\ne d 4\n' > $(tmp).3
+printf '1\n2\n3\n' > $(tmp).1
+$JF -dag -threads=4 -exec sh -c 'test $1 = fail && exit 1 ; echo $1' sh {} < $(tmp).3 > $(tmp).2 && echo "test $testno failed."
+test_equal $(tmp).1 $(tmp).2
+
+dotest "cache replays buffered output"
+seq 20 > $(tmp).3
+$JF -threads=4 -buffered -cache=$(tmp).4 -exec sh -c 'echo $1 ; touch $0' $(tmp).5 {} < $(tmp).3 | sort -n > $(tmp).1
+rm -f $(tmp).5
+$JF -threads=4 -buffered -cache=$(tmp).4 -exec sh -c 'echo $1 ; touch $0' $(tmp).5 {} < $(tmp).3 | sort -n > $(tmp).2
+test -e $(tmp).5 && echo "test $testno failed."
+rm -f $(tmp).4 $(tmp).4.data $(tmp).5
+test_equal $(tmp).3 $(tmp).2
+
+dotest "dedup keeps order and numbering"
+printf 'a\nb\na\nc\nb\n' | $JF -dedup -exec echo {#} {} > $(tmp).2
+printf '1 a\n2 b\n4 c\n' > $(tmp).1
+test_equal $(tmp).1 $(tmp).2
+
+dotest "uring pipe and buffered"
+seq 100000 > $(tmp).3
+$JF -uring -threads=4 -exec sh -c 'cat > $0.$$' $(tmp).4 < $(tmp).3
+cat $(tmp).4.* | sort -n > $(tmp).2
+rm -f $(tmp).4.*
+test_equal $(tmp).3 $(tmp).2
+seq 10 | $JF -uring -threads=3 -buffered -exec seq {} | sort -n > $(tmp).2
+seq 10 | $JF -threads=3 -buffered -exec seq {} | sort -n > $(tmp).1
+test_equal $(tmp).1 $(tmp).2
+
+dotest "field placeholders"
+printf 'a,b,c\nd,e\n' | $JF -delim , -exec echo {2} {-1} '{1..2}' '{2..-1}' > $(tmp).2
+printf 'b c a,b b,c\ne e d,e e\n' > $(tmp).1
+test_equal $(tmp).1 $(tmp).2
+
+dotest "braces without -delim"
+printf 'a b\n' | $JF -exec sh -c 'echo ${1} {1} $0' {} > $(tmp).2
+printf 'a b\n' | $JF -delim blank -exec sh -c 'echo ${1} {2}' sh {1} >> $(tmp).2
+printf 'x{2}\n' | $JF -exec grep 'x{2}' >> $(tmp).2
+printf '{1} a b\na b\nx{2}\n' > $(tmp).1
+test_equal $(tmp).1 $(tmp).2
+
+dotest "spawners"
+seq 1000 > $(tmp).1
+$JF -spawners 2 -threads 4 -exec echo {} < $(tmp).1 | sort -n > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+seq 3 | $JF -spawners 2 -threads 2 -exec /nonexistent/cmd {} 2>/dev/null && echo "test $testno failed."
+printf '1048576\n1048576\n' > $(tmp).1
+printf 'a\nb\n' | $JF -spawners 1 -threads 2 -limits mem=1024M -exec sh -c 'ulimit -v' > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+
+dotest "record formats"
+printf 'a b\0c\nd\0' | $JF -0 -exec echo '[{}]' > $(tmp).2
+printf '[a b]\n[c\nd]\n' > $(tmp).1
+test_equal $(tmp).1 $(tmp).2
+printf 'x::y::z' | $JF -rs '::' -skip 1 -exec echo {#} {} > $(tmp).2
+printf '2 y\n3 z\n' > $(tmp).1
+test_equal $(tmp).1 $(tmp).2
+printf 'aaabbbcccddd' > $(tmp).3
+$JF -recsize 3 -skip 2 -exec echo {#} {} < $(tmp).3 > $(tmp).2
+cat $(tmp).3 | $JF -recsize 3 -skip 2 -exec echo {#} {} >> $(tmp).2
+printf '3 ccc\n4 ddd\n3 ccc\n4 ddd\n' > $(tmp).1
+test_equal $(tmp).1 $(tmp).2
+seq 3000 | tr '\n' '\0' > $(tmp).3
+$JF -0 -bulk 4K -threads 3 -exec sh -c 'tr "\0" "\n" > $0.$$' $(tmp).4 < $(tmp).3
+cat $(tmp).4.* | sort -n > $(tmp).2
+rm -f $(tmp).4.*
+seq 3000 > $(tmp).1
+test_equal $(tmp).1 $(tmp).2
+
+dotest "records longer than a chunk"
+i=1 ; while [ $i -le 40 ] ; do
+	echo "$(head -c $((i * 997 % 50000)) /dev/zero | tr '\0' x)$i"
+	i=$((i + 1))
+done > $(tmp).5
+awk '{ print length($0) }' $(tmp).5 > $(tmp).1
+$JF -exec sh -c 'printf "%s\n" ${#1}' sh {} < $(tmp).5 > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+$JF -threads 3 -bulk 4K -exec sh -c 'cat > $0.$$' $(tmp).4 < $(tmp).5
+cat $(tmp).4.* | sort > $(tmp).2
+rm -f $(tmp).4.*
+sort $(tmp).5 > $(tmp).1
+rm -f $(tmp).5
+test_equal $(tmp).1 $(tmp).2
+
+dotest "coalesce 3x"
+seq 100000 > $(tmp).1
+$JF -threads=3 -coalesce=4K -exec sh -c 'cat > $0.$$' $(tmp).4 < $(tmp).1
+cat $(tmp).4.* | sort -n > $(tmp).2
+rm -f $(tmp).4.*
+test_equal $(tmp).1 $(tmp).2
+(echo a ; sleep 2 ; echo b) | $JF -coalesce=64K -exec sh -c 'read x ; date +%s ; read x ; date +%s' > $(tmp).2
+test $(($(tail -n 1 $(tmp).2) - $(head -n 1 $(tmp).2))) -ge 1 || echo "test $testno failed."
+rm -f $(tmp).2
+
+dotest "rate and bwlimit"
+start=$(date +%s)
+seq 7 | $JF -threads=4 -rate=2 -burst=2 -exec true {}
+test $(($(date +%s) - start)) -ge 2 || echo "test $testno failed."
+start=$(date +%s)
+seq 10000 > $(tmp).1
+$JF -threads=2 -bwlimit=16K -exec sh -c 'cat > $0.$$' $(tmp).4 < $(tmp).1
+test $(($(date +%s) - start)) -ge 1 || echo "test $testno failed."
+cat $(tmp).4.* | sort -n > $(tmp).2
+rm -f $(tmp).4.*
+test_equal $(tmp).1 $(tmp).2
+
+dotest "halt and resume"
+rm -f $(tmp).5
+seq 10 | $JF -halt=3 -statefile=$(tmp).5 -exec sh -c 'echo $0; test $0 -lt 5' {} > $(tmp).2 2>/dev/null
+test $? = 1 || echo "test $testno failed."
+seq 10 | $JF -resume -statefile=$(tmp).5 -exec echo {} >> $(tmp).2
+rm -f $(tmp).5
+{ seq 7; seq 5 10; } > $(tmp).1
+test_equal $(tmp).1 $(tmp).2
+
+dotest "libjobflow substitution"
+printf 'a.b,c,d\nx\n' > $(tmp).3
+printf '1 a.b,c,d a c a.b,c d ${1}\n2 x x  x x ${1}\n' > $(tmp).1
+tests/lib_subst.out '{#} {} {.} {2} {1..2} {-1} ${1}' < $(tmp).3 > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+
+dotest "speculate runs a straggler twice"
+seq 20 > $(tmp).1
+$JF -threads=4 -buffered -speculate=3 -exec sh -c 'echo "$1" >> "$2.log"; test "$1" = 20 && mkdir "$2" 2>/dev/null && { trap "" TERM; sleep 3; }; echo "$1"' sh {} $(tmp).4 < $(tmp).1 > /dev/null
+{ seq 19; echo 20; echo 20; } > $(tmp).1
+sort -n $(tmp).4.log > $(tmp).2
+rm -rf $(tmp).4 $(tmp).4.log
+test_equal $(tmp).1 $(tmp).2
+
+dotest "walk with -0"
+mkdir -p $(tmp).4/a
+touch $(tmp).4/a/x "$(tmp).4/a/y
+z"
+find $(tmp).4 -print0 | tr '\0\n' '\n|' | sort > $(tmp).1
+$JF -walk $(tmp).4 -0 -exec printf '%s\0' {} | tr '\0\n' '\n|' | sort > $(tmp).2
+rm -rf $(tmp).4
+test_equal $(tmp).1 $(tmp).2
+
+dotest "stream with -0"
+printf 'a\0b\nc\0d' > $(tmp).3
+printf '[a]\n[b\nc]\n[d]\n' > $(tmp).1
+$JF -threads=1 -stream path=$(tmp).3 -0 -exec printf '[%s]\n' {} > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+
+dotest "dag with -rs"
+printf 'a - 1;;b a 2\n3;;c b 4;;' > $(tmp).3
+printf '1\n2\n3\n4\n' > $(tmp).1
+$JF -dag -rs ';;' -exec sh -c 'printf "%s\n" "$1"' sh {} < $(tmp).3 > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+
+dotest "limits apply before exec"
+seq 20 | sed 's/.*/17/' > $(tmp).1
+seq 20 | $JF -threads=4 -limits nofiles=17 -exec sh -c 'ulimit -n' sh {} > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+
+dotest "argpermutation mixed"
+echo 'foobar.bmp foobar 1' > $(tmp).1
+echo foobar.bmp | $JF -exec echo '{} {.} {#}' > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
+
+dotest "argpermutation per argument"
+printf 'bmp2jpeg foobar.bmp foobar.jpg foobar.bmp 1\nbmp2jpeg a{.}b.bmp a{.}b.jpg a{.}b.c 2\n' > $(tmp).1
+printf 'foobar.bmp\na{.}b.c\n' | $JF -threads=1 -exec echo bmp2jpeg {.}.bmp {.}.jpg {} {#} > $(tmp).2
+test_equal $(tmp).1 $(tmp).2
@@ -0,0 +1,20 @@
+/* prints the template given as argument with the placeholders substituted
+   by libjobflow for each line of stdin, with fields separated by commas. */
+#include <stdio.h>
+#include <string.h>
+#include "../libjobflow.h"
+
+int main(int argc, char **argv) {
+	char line[4096], out[4096];
+	unsigned long long lineno = 0;
+	jobflow_fields f = {0};
+	if(argc < 2) return 1;
+	while(fgets(line, sizeof line, stdin)) {
+		f.valid = 0;
+		if(jobflow_subst(out, sizeof out, argv[1], line, strcspn(line, "\n"), ++lineno, ',', &f) == -1)
+			return 1;
+		puts(out);
+	}
+	jobflow_fields_free(&f);
+	return 0;
+}
@@ -0,0 +1,23 @@
+/* jobflow plugin printing each record, optionally with a prefix passed
+   via -exec. records equal to "fail" make it report an error, and so does
+   jobflow_init() for the prefix "initfail". */
+#include <string.h>
+#include "../jobflow_plugin.h"
+
+int jobflow_init(void **ctx, int argc, char **argv) {
+	*ctx = argc > 0 ? argv[0] : "";
+	return !strcmp(*ctx, "initfail");
+}
+
+ssize_t jobflow_process(void *ctx, const char *rec, size_t len,
+                        unsigned long long lineno, char *out, size_t outsize) {
+	const char *prefix = ctx;
+	size_t pl = strlen(prefix), need = pl + len + 1;
+	(void) lineno;
+	if(!strcmp(rec, "fail")) return -1;
+	if(need > outsize) return need;
+	memcpy(out, prefix, pl);
+	memcpy(out + pl, rec, len);
+	out[pl + len] = '\n';
+	return need;
+}